@@ -19,7 +19,9 @@
 #include "mbed_error.h"
 #include "nsapi_types.h"
 #include "PinNames.h"
+#include "us_ticker_api.h"
 
+#include <cstdio>
 #include <cstring>
 
 #define ESP8266_DEFAULT_BAUD_RATE   115200
@@ -29,6 +31,9 @@ ESP8266::ESP8266(PinName tx, PinName rx, bool debug, PinName rts, PinName cts)
     : _sdk_v(-1,-1,-1),
       _at_v(-1,-1,-1),
       _tcp_passive(false),
+      _tcp_adaptive(false),
+      _tcp_mode_check(false),
+      _tcp_sched_next(0),
       _serial(tx, rx, ESP8266_DEFAULT_BAUD_RATE),
       _serial_rts(rts),
       _serial_cts(cts),
@@ -36,10 +41,16 @@ ESP8266::ESP8266(PinName tx, PinName rx, bool debug, PinName rts, PinName cts)
       _packets(0),
       _packets_end(&_packets),
       _heap_usage(0),
+      _sock_ready(0),
+      _sock_ready_cond(_smutex),
       _connect_error(0),
       _fail(false),
       _sock_already(false),
       _closed(false),
+      _wdt_reset(false),
+      _dinfo(false),
+      _ssl_bufsize(MBED_CONF_ESP8266_SSL_BUFSIZE),
+      _ssl_bufsize_set(false),
       _conn_status(NSAPI_STATUS_DISCONNECTED)
 {
     _serial.set_baud( ESP8266_DEFAULT_BAUD_RATE );
@@ -66,16 +77,56 @@ ESP8266::ESP8266(PinName tx, PinName rx, bool debug, PinName rts, PinName cts)
     // Don't see a reason to make distiction between software(Software WDT reset) and hardware(wdt reset) watchdog treatment
     //https://github.com/esp8266/Arduino/blob/4897e0006b5b0123a2fa31f67b14a3fff65ce561/doc/faq/a02-my-esp-crashes.md#watchdog
     _parser.oob("Soft WDT reset", callback(this, &ESP8266::_oob_watchdog_reset));
+    _parser.oob("+CWLAP:", callback(this, &ESP8266::_oob_scan_result));
+
+    _scan_active = false;
+    _scan_start = 0;
+    _scan_count = 0;
+    _scan_status = 0;
+    _scan_res = 0;
+    _scan_limit = 0;
+    _scan_rssi = 0;
+    _scan_mask = SCAN_DEFAULT;
+    _scan_sort = false;
+    _scan_opts_set = true;
+    _scan_filtered = false;
+    _scan_cache_len = 0;
+    _scan_cache_ms = 0;
+    _scan_cache_valid = false;
+    _join_active = false;
+    _join_start = 0;
+
+    _tcp_recv_mode_stats.to_passive = 0;
+    _tcp_recv_mode_stats.to_active = 0;
 
     for(int i= 0; i < SOCKET_COUNT; i++) {
         _sock_i[i].open = false;
         _sock_i[i].proto = NSAPI_UDP;
+        _sock_i[i].tcp_data_avbl = 0;
+        _sock_i[i].tcp_deficit = 0;
+        _sock_i[i].tcp_weight = 1;
+        _sock_i[i].rx_buffered = 0;
+        _sock_i[i].rx_packets = 0;
+        _sock_i[i].event_us = 0;
+        _sock_i[i].hup = false;
+        _sock_i[i].lost = false;
+        _sock_i[i].rx_wait_buf = 0;
+        _sock_i[i].rx_wait_len = 0;
+        _sock_i[i].rx_placed = -1;
+        _sock_i[i].rx_full_len = 0;
+        _sock_i[i].gen = 0;
+        _sock_i[i].opening = false;
+        _sock_i[i].any_remote = false;
+        _sock_i[i].rcvbuf = 0;
     }
+
+    memset(&_recv_wakeup_stats, 0, sizeof(_recv_wakeup_stats));
 }
 
 bool ESP8266::at_available()
 {
     _smutex.lock();
+    _scan_wait();
     bool ready = _parser.send("AT")
            && _parser.recv("OK\n");
     _smutex.unlock();
@@ -90,6 +141,7 @@ struct ESP8266::fw_sdk_version ESP8266::sdk_version()
     int patch;
 
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+GMR")
         && _parser.recv("SDK version:%d.%d.%d", &major, &minor, &patch)
         && _parser.recv("OK\n");
@@ -111,6 +163,7 @@ struct ESP8266::fw_at_version ESP8266::at_version()
     int nused;
 
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+GMR")
         && _parser.recv("AT version:%d.%d.%d.%d", &major, &minor, &patch, &nused)
         && _parser.recv("OK\n");
@@ -178,6 +231,7 @@ bool ESP8266::startup(int mode)
     }
 
     _smutex.lock();
+    _scan_wait();
     set_timeout(ESP8266_CONNECT_TIMEOUT);
     bool done = _parser.send("AT+CWMODE_CUR=%d", mode)
             && _parser.recv("OK\n")
@@ -192,6 +246,7 @@ bool ESP8266::startup(int mode)
 bool ESP8266::reset(void)
 {
     _smutex.lock();
+    _scan_wait();
     set_timeout(ESP8266_CONNECT_TIMEOUT);
 
     for (int i = 0; i < 2; i++) {
@@ -199,6 +254,9 @@ bool ESP8266::reset(void)
             && _parser.recv("OK\n")
             && _parser.recv("ready")) {
             _clear_socket_packets(ESP8266_ALL_SOCKET_IDS);
+            _dinfo = false;
+            _ssl_bufsize_set = false;
+            _scan_opts_set = false;
             _smutex.unlock();
             return true;
         }
@@ -217,6 +275,7 @@ bool ESP8266::dhcp(bool enabled, int mode)
     }
 
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+CWDHCP_CUR=%d,%d", mode, enabled?1:0)
                 && _parser.recv("OK\n");
     _smutex.unlock();
@@ -229,40 +288,79 @@ bool ESP8266::cond_enable_tcp_passive_mode()
     bool done = true;
 
     if (FW_AT_LEAST_VERSION(_at_v.major, _at_v.minor, _at_v.patch, 0, ESP8266_AT_VERSION_TCP_PASSIVE_MODE)) {
+#if MBED_CONF_ESP8266_TCP_ADAPTIVE_RECV_MODE
+        // Start in active mode, switched to passive only under memory pressure
+        _tcp_adaptive = true;
         _smutex.lock();
-        done = _parser.send("AT+CIPRECVMODE=1")
-                && _parser.recv("OK\n");
+        done = _set_tcp_recv_mode(false);
+        _smutex.unlock();
+#else
+        _smutex.lock();
+        done = _set_tcp_recv_mode(true);
         _smutex.unlock();
+#endif
+    }
+
+    return done;
+}
 
-        _tcp_passive = done ? true : false;
+bool ESP8266::_set_tcp_recv_mode(bool passive)
+{
+    _scan_wait();
+    bool done = _parser.send("AT+CIPRECVMODE=%d", passive ? 1 : 0)
+            && _parser.recv("OK\n");
+
+    if (done) {
+        _tcp_passive = passive;
     }
 
     return done;
 }
 
+void ESP8266::_adapt_tcp_recv_mode()
+{
+    if (!_tcp_adaptive) {
+        return;
+    }
+
+    if (!_tcp_passive) {
+        // Let modem hold TCP data before packets start to be dropped
+        if (_heap_usage >= ESP8266_TCP_PASSIVE_HIGH_WATERMARK && _set_tcp_recv_mode(true)) {
+            _tcp_recv_mode_stats.to_passive++;
+        }
+    } else if (_heap_usage <= ESP8266_TCP_PASSIVE_LOW_WATERMARK) {
+        // Data left on the modem would not be pushed anymore
+        for (int i = 0; i < SOCKET_COUNT; i++) {
+            if (_sock_i[i].tcp_data_avbl != 0) {
+                return;
+            }
+        }
+        if (_set_tcp_recv_mode(false)) {
+            _tcp_recv_mode_stats.to_active++;
+        }
+    }
+}
+
+struct ESP8266::recv_mode_stats ESP8266::tcp_recv_mode_stats()
+{
+    _smutex.lock();
+    struct recv_mode_stats stats = _tcp_recv_mode_stats;
+    _smutex.unlock();
+
+    return stats;
+}
 
-nsapi_error_t ESP8266::connect(const char *ap, const char *passPhrase)
+nsapi_error_t ESP8266::connect(const char *ap, const char *passPhrase, const uint8_t *bssid)
 {
     _smutex.lock();
+    _scan_wait();
     set_timeout(ESP8266_CONNECT_TIMEOUT);
 
-    _parser.send("AT+CWJAP_CUR=\"%s\",\"%s\"", ap, passPhrase);
+    _send_join(ap, passPhrase, bssid);
     if (!_parser.recv("OK\n")) {
         if (_fail) {
             _smutex.unlock();
-            nsapi_error_t ret;
-            if (_connect_error == 1)
-                ret = NSAPI_ERROR_CONNECTION_TIMEOUT;
-            else if (_connect_error == 2)
-                ret = NSAPI_ERROR_AUTH_FAILURE;
-            else if (_connect_error == 3)
-                ret = NSAPI_ERROR_NO_SSID;
-            else
-                ret = NSAPI_ERROR_NO_CONNECTION;
-
-            _fail = false;
-            _connect_error = 0;
-            return ret;
+            return _join_error();
         }
     }
     set_timeout();
@@ -271,9 +369,97 @@ nsapi_error_t ESP8266::connect(const char *ap, const char *passPhrase)
     return NSAPI_ERROR_OK;
 }
 
+nsapi_error_t ESP8266::connect_async(const char *ap, const char *passPhrase, const uint8_t *bssid,
+                                     Callback<void(nsapi_error_t)> cb)
+{
+    _smutex.lock();
+    if (_join_active) {
+        _smutex.unlock();
+        return NSAPI_ERROR_IN_PROGRESS;
+    }
+    _scan_wait();
+
+    if (!_send_join(ap, passPhrase, bssid)) {
+        _smutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    // Modem answers with WIFI status lines and OK or FAIL, see _join_poll
+    _join_cb = cb;
+    _join_active = true;
+    _join_start = rtos::Kernel::get_ms_count();
+    _smutex.unlock();
+
+    return NSAPI_ERROR_OK;
+}
+
+bool ESP8266::_send_join(const char *ap, const char *passPhrase, const uint8_t *bssid)
+{
+    if (bssid) {
+        return _parser.send("AT+CWJAP_CUR=\"%s\",\"%s\",\"%02x:%02x:%02x:%02x:%02x:%02x\"", ap, passPhrase,
+                            bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+    }
+    return _parser.send("AT+CWJAP_CUR=\"%s\",\"%s\"", ap, passPhrase);
+}
+
+nsapi_error_t ESP8266::_join_error()
+{
+    nsapi_error_t ret;
+    if (_connect_error == 1)
+        ret = NSAPI_ERROR_CONNECTION_TIMEOUT;
+    else if (_connect_error == 2)
+        ret = NSAPI_ERROR_AUTH_FAILURE;
+    else if (_connect_error == 3)
+        ret = NSAPI_ERROR_NO_SSID;
+    else
+        ret = NSAPI_ERROR_NO_CONNECTION;
+
+    _fail = false;
+    _connect_error = 0;
+    return ret;
+}
+
+void ESP8266::_join_poll(uint32_t timeout)
+{
+    uint64_t elapsed = rtos::Kernel::get_ms_count() - _join_start;
+    if (elapsed >= ESP8266_CONNECT_TIMEOUT) {
+        _join_end(NSAPI_ERROR_CONNECTION_TIMEOUT);
+        return;
+    }
+    if (timeout > ESP8266_CONNECT_TIMEOUT - elapsed) {
+        timeout = ESP8266_CONNECT_TIMEOUT - elapsed;
+    }
+
+    // Status lines and socket data are handled as OOBs while waiting
+    set_timeout(timeout);
+    bool done = _parser.recv("OK\n");
+    set_timeout();
+
+    if (done) {
+        _join_end(NSAPI_ERROR_OK);
+    } else if (_fail) {
+        _join_end(_join_error());
+    } else if (_error) {
+        _error = false;
+        _join_end(NSAPI_ERROR_DEVICE_ERROR);
+    }
+}
+
+void ESP8266::_join_end(nsapi_error_t status)
+{
+    Callback<void(nsapi_error_t)> cb = _join_cb;
+
+    _join_active = false;
+    _join_cb = 0;
+    if (cb) {
+        cb(status);
+    }
+}
+
 bool ESP8266::disconnect(void)
 {
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+CWQAP") && _parser.recv("OK\n");
     _smutex.unlock();
 
@@ -283,6 +469,7 @@ bool ESP8266::disconnect(void)
 const char *ESP8266::ip_addr(void)
 {
     _smutex.lock();
+    _scan_wait();
     set_timeout(ESP8266_CONNECT_TIMEOUT);
     if (!(_parser.send("AT+CIFSR")
         && _parser.recv("+CIFSR:STAIP,\"%15[^\"]\"", _ip_buffer)
@@ -299,6 +486,7 @@ const char *ESP8266::ip_addr(void)
 const char *ESP8266::mac_addr(void)
 {
     _smutex.lock();
+    _scan_wait();
     if (!(_parser.send("AT+CIFSR")
         && _parser.recv("+CIFSR:STAMAC,\"%17[^\"]\"", _mac_buffer)
         && _parser.recv("OK\n"))) {
@@ -313,6 +501,7 @@ const char *ESP8266::mac_addr(void)
 const char *ESP8266::gateway()
 {
     _smutex.lock();
+    _scan_wait();
     if (!(_parser.send("AT+CIPSTA_CUR?")
         && _parser.recv("+CIPSTA_CUR:gateway:\"%15[^\"]\"", _gateway_buffer)
         && _parser.recv("OK\n"))) {
@@ -327,6 +516,7 @@ const char *ESP8266::gateway()
 const char *ESP8266::netmask()
 {
     _smutex.lock();
+    _scan_wait();
     if (!(_parser.send("AT+CIPSTA_CUR?")
         && _parser.recv("+CIPSTA_CUR:netmask:\"%15[^\"]\"", _netmask_buffer)
         && _parser.recv("OK\n"))) {
@@ -344,6 +534,7 @@ int8_t ESP8266::rssi()
     char bssid[18];
 
     _smutex.lock();
+    _scan_wait();
     set_timeout(ESP8266_CONNECT_TIMEOUT);
     if (!(_parser.send("AT+CWJAP_CUR?")
         && _parser.recv("+CWJAP_CUR:\"%*[^\"]\",\"%17[^\"]\"", bssid)
@@ -355,49 +546,254 @@ int8_t ESP8266::rssi()
    _smutex.unlock();
 
    _smutex.lock();
+   _scan_wait();
    set_timeout(ESP8266_CONNECT_TIMEOUT);
-    if (!(_parser.send("AT+CWLAP=\"\",\"%s\",", bssid)
-        && _parser.recv("+CWLAP:(%*d,\"%*[^\"]\",%hhd,", &rssi)
-        && _parser.recv("OK\n"))) {
-        _smutex.unlock();
-        return 0;
+    // Field is needed here even if left out of the application's scans
+    uint16_t mask = _scan_mask;
+    if (!(mask & SCAN_RSSI)) {
+        _scan_mask |= SCAN_RSSI;
+        _scan_opts_set = false;
+    }
+    // +CWLAP line is taken by _oob_scan_result
+    _scan_count = 0;
+    bool done = _scan_opts_apply()
+                && _parser.send("AT+CWLAP=\"\",\"%s\",", bssid)
+                && _parser.recv("OK\n")
+                && _scan_count;
+    if (_scan_mask != mask) {
+        _scan_mask = mask; // Application's options go back with its next scan
+        _scan_opts_set = false;
     }
+    rssi = done ? _scan_rssi : 0;
     set_timeout();
     _smutex.unlock();
 
     return rssi;
 }
 
-int ESP8266::scan(WiFiAccessPoint *res, unsigned limit)
+int ESP8266::scan(WiFiAccessPoint *res, unsigned limit, const char *ssid, uint8_t channel)
 {
-    unsigned cnt = 0;
-    nsapi_wifi_ap_t ap;
+    _smutex.lock();
+    _scan_wait();
+    _scan_res = res;
+    _scan_limit = limit;
+    nsapi_error_t status = scan_async(callback(this, &ESP8266::_scan_fill), ssid, channel);
+    _scan_wait();
+    _scan_res = 0;
+    _smutex.unlock();
 
+    if (status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    // Results received before a failure are returned as with a completed scan
+    return limit != 0 && _scan_count > limit ? limit : _scan_count;
+}
+
+nsapi_error_t ESP8266::scan_async(Callback<void(const WiFiAccessPoint *, int)> cb, const char *ssid,
+                                  uint8_t channel)
+{
     _smutex.lock();
-    set_timeout(ESP8266_CONNECT_TIMEOUT);
+    if (_scan_active) {
+        _smutex.unlock();
+        return NSAPI_ERROR_IN_PROGRESS;
+    }
+    _scan_wait();
 
-    if (!_parser.send("AT+CWLAP")) {
+    if (!_scan_opts_apply()) {
         _smutex.unlock();
         return NSAPI_ERROR_DEVICE_ERROR;
     }
 
-    while (_recv_ap(&ap)) {
-        if (cnt < limit) {
-            res[cnt] = WiFiAccessPoint(ap);
+    _scan_count = 0;
+    _scan_filtered = ssid || channel;
+    bool sent;
+    if (ssid && channel) {
+        sent = _parser.send("AT+CWLAP=\"%s\",,%d", ssid, channel);
+    } else if (ssid) {
+        sent = _parser.send("AT+CWLAP=\"%s\"", ssid);
+    } else if (channel) {
+        sent = _parser.send("AT+CWLAP=,,%d", channel);
+    } else {
+        sent = _parser.send("AT+CWLAP");
+    }
+    if (!sent) {
+        _smutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    // Modem answers with +CWLAP lines and OK, see _scan_poll
+    _scan_cb = cb;
+    _scan_active = true;
+    _scan_start = rtos::Kernel::get_ms_count();
+    _smutex.unlock();
+
+    return NSAPI_ERROR_OK;
+}
+
+bool ESP8266::set_scan_options(bool sort, uint16_t mask)
+{
+    _smutex.lock();
+    _scan_wait();
+    _scan_sort = sort;
+    _scan_mask = mask & SCAN_DEFAULT;
+    _scan_opts_set = _parser.send("AT+CWLAPOPT=%d,%d", _scan_sort ? 1 : 0, _scan_mask)
+                     && _parser.recv("OK\n");
+    _smutex.unlock();
+
+    return _scan_opts_set;
+}
+
+bool ESP8266::_scan_opts_apply()
+{
+    // Modem is back with its default options after a reset
+    if (!_scan_opts_set) {
+        _scan_opts_set = _parser.send("AT+CWLAPOPT=%d,%d", _scan_sort ? 1 : 0, _scan_mask)
+                         && _parser.recv("OK\n");
+    }
+    return _scan_opts_set;
+}
+
+void ESP8266::_scan_poll(uint32_t timeout)
+{
+    uint64_t elapsed = rtos::Kernel::get_ms_count() - _scan_start;
+    if (elapsed >= ESP8266_CONNECT_TIMEOUT) {
+        _scan_end(NSAPI_ERROR_TIMEOUT);
+        return;
+    }
+    if (timeout > ESP8266_CONNECT_TIMEOUT - elapsed) {
+        timeout = ESP8266_CONNECT_TIMEOUT - elapsed;
+    }
+
+    // Results and socket data are handled as OOBs while waiting
+    set_timeout(timeout);
+    bool done = _parser.recv("OK\n");
+    set_timeout();
+
+    if (done) {
+        _scan_end(NSAPI_ERROR_OK);
+    } else if (_error) {
+        _error = false;
+        _scan_end(NSAPI_ERROR_DEVICE_ERROR);
+    }
+}
+
+void ESP8266::_scan_wait()
+{
+    // Modem takes no commands before AT+CWLAP or AT+CWJAP_CUR is over
+    while (_scan_active || _join_active) {
+        if (_scan_active) {
+            _scan_poll(ESP8266_CONNECT_TIMEOUT);
+        } else {
+            _join_poll(ESP8266_CONNECT_TIMEOUT);
+        }
+    }
+}
+
+void ESP8266::_scan_end(nsapi_error_t status)
+{
+    Callback<void(const WiFiAccessPoint *, int)> cb = _scan_cb;
+
+    _scan_active = false;
+    _scan_cb = 0;
+    _scan_status = status;
+
+    // Access points a full scan did not see are gone
+    if (status == NSAPI_ERROR_OK && !_scan_filtered) {
+        unsigned n = 0;
+        for (unsigned i = 0; i < _scan_cache_len; i++) {
+            if (_scan_cache[i].seen_ms >= _scan_start) {
+                _scan_cache[n++] = _scan_cache[i];
+            }
         }
+        _scan_cache_len = n;
+        _scan_cache_ms = _scan_start;
+        _scan_cache_valid = true;
+    }
+
+    if (cb) {
+        cb(0, status != NSAPI_ERROR_OK ? status : (int)_scan_count);
+    }
+}
+
+void ESP8266::_scan_cache_add(const nsapi_wifi_ap_t *ap)
+{
+    // BSSID tells access points apart
+    if (!(_scan_mask & SCAN_MAC)) {
+        return;
+    }
 
-        cnt++;
-        if (limit != 0 && cnt >= limit) {
+    // When full, entries the running scan has not seen go first, then the weakest. Strongest
+    // access points are the ones connect() and roaming choose from.
+    unsigned victim = 0;
+    unsigned i = 0;
+    for (; i < _scan_cache_len; i++) {
+        if (memcmp(_scan_cache[i].ap.bssid, ap->bssid, sizeof(ap->bssid)) == 0) {
             break;
         }
+        bool stale = _scan_cache[i].seen_ms < _scan_start;
+        bool victim_stale = _scan_cache[victim].seen_ms < _scan_start;
+        if ((stale && !victim_stale)
+                || (stale == victim_stale && _scan_cache[i].ap.rssi < _scan_cache[victim].ap.rssi)) {
+            victim = i;
+        }
+    }
+
+    if (i == _scan_cache_len) {
+        if (_scan_cache_len < ESP8266_SCAN_CACHE_SIZE) {
+            _scan_cache_len++;
+        } else if (_scan_cache[victim].seen_ms >= _scan_start && _scan_cache[victim].ap.rssi >= ap->rssi) {
+            return; // Weaker than all cached
+        } else {
+            i = victim;
+        }
+    }
+    _scan_cache[i].ap = *ap;
+    _scan_cache[i].seen_ms = rtos::Kernel::get_ms_count();
+}
+
+int ESP8266::scan_cached(WiFiAccessPoint *res, unsigned limit, uint32_t max_age_ms, const char *ssid,
+                         uint8_t channel)
+{
+    unsigned idx[ESP8266_SCAN_CACHE_SIZE];
+    unsigned cnt = 0;
+
+    _smutex.lock();
+    if (!_scan_cache_valid || rtos::Kernel::get_ms_count() - _scan_cache_ms > max_age_ms) {
+        _smutex.unlock();
+        return scan(res, limit, ssid, channel);
+    }
+
+    for (unsigned i = 0; i < _scan_cache_len; i++) {
+        const nsapi_wifi_ap_t *ap = &_scan_cache[i].ap;
+        if ((ssid && strcmp(ap->ssid, ssid) != 0) || (channel && ap->channel != channel)) {
+            continue;
+        }
+
+        // Strongest first as modem would list them
+        unsigned j = cnt++;
+        for (; _scan_sort && j > 0 && _scan_cache[idx[j - 1]].ap.rssi < ap->rssi; j--) {
+            idx[j] = idx[j - 1];
+        }
+        idx[j] = i;
+    }
+
+    for (unsigned i = 0; i < cnt && i < limit; i++) {
+        res[i] = WiFiAccessPoint(_scan_cache[idx[i]].ap);
     }
-    set_timeout();
     _smutex.unlock();
 
-    return cnt;
+    return limit != 0 && cnt > limit ? limit : cnt;
+}
+
+void ESP8266::_scan_fill(const WiFiAccessPoint *ap, int /* status, scan() reads _scan_status */)
+{
+    if (ap && _scan_count <= _scan_limit) {
+        _scan_res[_scan_count - 1] = *ap;
+    }
 }
 
-nsapi_error_t ESP8266::open_udp(int id, const char* addr, int port, int local_port)
+nsapi_error_t ESP8266::open_udp(int id, const char* addr, int port, int local_port, int mode)
 {
     static const char *type = "UDP";
     bool done = false;
@@ -407,9 +803,30 @@ nsapi_error_t ESP8266::open_udp(int id, const char* addr, int port, int local_po
     }
 
     _smutex.lock();
+    _scan_wait();
+    _sock_i[id].tcp_data_avbl = 0;
+
+    // New connection, whatever is left of the previous one on this link is stale
+    _sock_i[id].gen++;
+    _sock_i[id].opening = true;
+    _sock_i[id].proto = NSAPI_UDP;
+    _sock_i[id].any_remote = mode == 2;
+    _clear_socket_packets(id);
+
+    // Datagrams from any remote end need their sender to be told apart
+    if (mode == 2 && !_dinfo) {
+        _dinfo = _parser.send("AT+CIPDINFO=1") && _parser.recv("OK\n");
+        if (!_dinfo) {
+            _sock_i[id].opening = false;
+            _smutex.unlock();
+            return NSAPI_ERROR_DEVICE_ERROR;
+        }
+    }
 
     for (int i = 0; i < 2; i++) {
-        if(local_port) {
+        if (mode) {
+            done = _parser.send("AT+CIPSTART=%d,\"%s\",\"%s\",%d,%d,%d", id, type, addr, port, local_port, mode);
+        } else if(local_port) {
             done = _parser.send("AT+CIPSTART=%d,\"%s\",\"%s\",%d,%d", id, type, addr, port, local_port);
         } else {
             done = _parser.send("AT+CIPSTART=%d,\"%s\",\"%s\",%d", id, type, addr, port);
@@ -419,8 +836,9 @@ nsapi_error_t ESP8266::open_udp(int id, const char* addr, int port, int local_po
             if (!_parser.recv("OK\n")) {
                 if (_sock_already) {
                     _sock_already = false; // To be raised again by OOB msg
-                    done = close(id);
-                    if (!done) {
+                    // Modem has a link we don't know of, settle the tables before retrying
+                    int live = sync_sockets();
+                    if (live < 0 || (live & (1 << id))) {
                         MBED_ERROR(MBED_MAKE_ERROR(MBED_MODULE_DRIVER, MBED_ERROR_CLOSE_FAILED), \
                                 "ESP8266::_open_udp: device refused to close socket");
                     }
@@ -436,16 +854,22 @@ nsapi_error_t ESP8266::open_udp(int id, const char* addr, int port, int local_po
             break;
         }
     }
-    _clear_socket_packets(id);
+    _sock_i[id].opening = false;
+    _sock_i[id].hup = false;
+    _sock_i[id].lost = false;
+    // Data of the new connection may already be buffered, keep it
+    if (!done) {
+        _clear_socket_packets(id);
+    }
 
     _smutex.unlock();
 
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
 }
 
-nsapi_error_t ESP8266::open_tcp(int id, const char* addr, int port, int keepalive)
+nsapi_error_t ESP8266::open_tcp(int id, const char* addr, int port, int keepalive, bool ssl)
 {
-    static const char *type = "TCP";
+    const char *type = ssl ? "SSL" : "TCP";
     bool done = false;
 
     if (id >= SOCKET_COUNT || _sock_i[id].open) {
@@ -453,6 +877,22 @@ nsapi_error_t ESP8266::open_tcp(int id, const char* addr, int port, int keepaliv
     }
 
     _smutex.lock();
+    _scan_wait();
+    _sock_i[id].tcp_data_avbl = 0;
+
+    // New connection, whatever is left of the previous one on this link is stale
+    _sock_i[id].gen++;
+    _sock_i[id].opening = true;
+    _sock_i[id].proto = NSAPI_TCP;
+    _clear_socket_packets(id);
+
+    if (ssl) {
+        // Buffer size is given before the connection, handshake takes its time
+        if (!_ssl_bufsize_set) {
+            _ssl_bufsize_set = _parser.send("AT+CIPSSLSIZE=%d", _ssl_bufsize) && _parser.recv("OK\n");
+        }
+        set_timeout(ESP8266_CONNECT_TIMEOUT);
+    }
 
     for (int i = 0; i < 2; i++) {
         if(keepalive) {
@@ -465,8 +905,9 @@ nsapi_error_t ESP8266::open_tcp(int id, const char* addr, int port, int keepaliv
             if (!_parser.recv("OK\n")) {
                 if (_sock_already) {
                     _sock_already = false; // To be raised again by OOB msg
-                    done = close(id);
-                    if (!done) {
+                    // Modem has a link we don't know of, settle the tables before retrying
+                    int live = sync_sockets();
+                    if (live < 0 || (live & (1 << id))) {
                         MBED_ERROR(MBED_MAKE_ERROR(MBED_MODULE_DRIVER, MBED_ERROR_CLOSE_FAILED), \
                                 "ESP8266::_open_tcp: device refused to close socket");
                     }
@@ -482,43 +923,81 @@ nsapi_error_t ESP8266::open_tcp(int id, const char* addr, int port, int keepaliv
             break;
         }
     }
-    _clear_socket_packets(id);
+    if (ssl) {
+        set_timeout();
+    }
+    _sock_i[id].opening = false;
+    _sock_i[id].hup = false;
+    _sock_i[id].lost = false;
+    // Data of the new connection may already be buffered, keep it
+    if (!done) {
+        _clear_socket_packets(id);
+    }
 
     _smutex.unlock();
 
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
 }
 
+bool ESP8266::set_ssl_buffer_size(int size)
+{
+    if (size < ESP8266_SSL_BUFSIZE_MIN || size > ESP8266_SSL_BUFSIZE_MAX) {
+        return false;
+    }
+
+    _smutex.lock();
+    _ssl_bufsize = size;
+    _ssl_bufsize_set = false; // Given to modem with next SSL connection
+    _smutex.unlock();
+
+    return true;
+}
+
+int ESP8266::open_tcp_each(struct tcp_open *opens, unsigned count)
+{
+    int opened = 0;
+
+    // Held over the whole batch, open_tcp locks it again
+    _smutex.lock();
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t start = rtos::Kernel::get_ms_count();
+        opens[i].result = open_tcp(opens[i].id, opens[i].addr, opens[i].port, opens[i].keepalive,
+                                   opens[i].ssl);
+        opens[i].ms = rtos::Kernel::get_ms_count() - start;
+        if (opens[i].result == NSAPI_ERROR_OK) {
+            opened++;
+        }
+    }
+    _smutex.unlock();
+
+    return opened;
+}
+
 bool ESP8266::dns_lookup(const char* name, char* ip)
 {
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+CIPDOMAIN=\"%s\"", name) && _parser.recv("+CIPDOMAIN:%s%*[\r]%*[\n]", ip);
     _smutex.unlock();
 
     return done;
 }
 
-nsapi_error_t ESP8266::send(int id, const void *data, uint32_t amount)
+nsapi_error_t ESP8266::send(int id, const void *data, uint32_t amount, const char *addr, int port)
 {
+    if (_sock_i[id].lost) {
+        return NSAPI_ERROR_CONNECTION_LOST;
+    }
+
     //May take a second try if device is busy
     for (unsigned i = 0; i < 2; i++) {
         _smutex.lock();
+        _scan_wait();
         set_timeout(ESP8266_SEND_TIMEOUT);
-        if (_parser.send("AT+CIPSEND=%d,%lu", id, amount)
-            && _parser.recv(">")
-            && _parser.write((char*)data, (int)amount) >= 0
-            && _parser.recv("SEND OK")) {
-            // No flow control, data overrun is possible
-            if (_serial_rts == NC) {
-                while (_parser.process_oob()); // Drain USART receive register
-            }
+        if (_send(id, data, amount, addr, port)) {
             _smutex.unlock();
             return NSAPI_ERROR_OK;
         }
-        if (_error) {
-            _error = false;
-        }
-
         set_timeout();
         _smutex.unlock();
     }
@@ -526,35 +1005,149 @@ nsapi_error_t ESP8266::send(int id, const void *data, uint32_t amount)
     return NSAPI_ERROR_DEVICE_ERROR;
 }
 
+bool ESP8266::_send(int id, const void *data, uint32_t amount, const char *addr, int port)
+{
+    bool sent = addr ? _parser.send("AT+CIPSEND=%d,%lu,\"%s\",%d", id, amount, addr, port)
+                     : _parser.send("AT+CIPSEND=%d,%lu", id, amount);
+    if (sent
+        && _parser.recv(">")
+        && _parser.write((char*)data, (int)amount) >= 0
+        && _parser.recv("SEND OK")) {
+        // No flow control, data overrun is possible
+        if (_serial_rts == NC) {
+            while (_parser.process_oob()); // Drain USART receive register
+        }
+        return true;
+    }
+    if (_error) {
+        _error = false;
+    }
+
+    return false;
+}
+
+int ESP8266::send_udp_batch(int id, struct udp_send *msgs, unsigned count)
+{
+    unsigned n = 0;
+
+    _smutex.lock();
+    _scan_wait();
+    set_timeout(ESP8266_SEND_TIMEOUT);
+    for (; n < count; n++) {
+        if (_sock_i[id].lost) {
+            msgs[n].result = NSAPI_ERROR_CONNECTION_LOST;
+            break;
+        }
+
+        //May take a second try if device is busy
+        bool sent = _send(id, msgs[n].data, msgs[n].len, msgs[n].addr, msgs[n].port)
+                    || _send(id, msgs[n].data, msgs[n].len, msgs[n].addr, msgs[n].port);
+        if (!sent) {
+            msgs[n].result = NSAPI_ERROR_DEVICE_ERROR;
+            break;
+        }
+        msgs[n].result = NSAPI_ERROR_OK;
+    }
+    set_timeout();
+    _smutex.unlock();
+
+    // Rest were not tried
+    for (unsigned i = n + 1; i < count; i++) {
+        msgs[i].result = NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    return n;
+}
+
 void ESP8266::_oob_packet_hdlr()
 {
     int id;
     int amount;
     int pdu_len;
 
+    char ip[16] = "";
+    int port = 0;
+
     // Get socket id
     if (!_parser.recv(",%d,", &id)) {
         return;
     }
-    // In passive mode amount not used...
+    // In passive mode data stays on the modem, only its amount is announced
     if(_tcp_passive
-            && _sock_i[id].open == true
+            && (_sock_i[id].open || _sock_i[id].opening)
             && _sock_i[id].proto == NSAPI_TCP) {
-        if (!_parser.recv("%d\n", &amount)) {
+        if (!_recv_ipd_len(true, &amount, ip, &port)) {
             MBED_ERROR(MBED_MAKE_ERROR(MBED_MODULE_DRIVER, MBED_ERROR_CODE_ENODATA), \
                     "ESP8266::_packet_handler(): Data length missing");
         }
+        _sock_i[id].tcp_data_avbl = amount;
+        _sock_event(id);
         return;
     // Amount required in active mode
-    } else if (!_parser.recv("%d:", &amount)) {
+    } else if (!_recv_ipd_len(false, &amount, ip, &port)) {
+        return;
+    }
+
+    // Late data of a connection already closed, no one is going to read it
+    if (!_sock_i[id].open && !_sock_i[id].opening) {
+        _discard(amount);
         return;
     }
 
+    // Make room for the datagram, readers of a mode 2 link may have gone away
+    if (_sock_i[id].any_remote && _sock_i[id].rx_packets >= ESP8266_UDP_ANY_REMOTE_QUEUE) {
+        for (struct packet **p = &_packets; *p; p = &(*p)->next) {
+            if ((*p)->id == id) {
+                struct packet *q = *p;
+                if (_packets_end == &(*p)->next) {
+                    _packets_end = p;
+                }
+                *p = (*p)->next;
+                _sock_i[id].rx_buffered -= q->len;
+                _sock_i[id].rx_packets--;
+                _heap_usage -= sizeof(struct packet) + q->alloc_len;
+                free(q);
+                break;
+            }
+        }
+    }
+
+    // Reader sleeping in recv and nothing buffered before this data, copy it straight to the reader
+    if (_sock_i[id].rx_wait_buf && _sock_i[id].rx_packets == 0) {
+        int placed = amount < (int)_sock_i[id].rx_wait_len ? amount : _sock_i[id].rx_wait_len;
+
+        if (_parser.read((char*)_sock_i[id].rx_wait_buf, placed) < placed) {
+            return;
+        }
+        _sock_i[id].rx_wait_buf = 0;
+        _sock_i[id].rx_placed = placed;
+        amount -= placed;
+
+        // Datagram truncated to reader's buffer
+        if (_sock_i[id].proto == NSAPI_UDP) {
+            _sock_i[id].rx_full_len = placed + amount;
+            _discard(amount);
+            amount = 0;
+        }
+        if (amount == 0) {
+            _sock_event(id);
+            return;
+        }
+        // Rest of the TCP data is buffered
+    }
+
     pdu_len = sizeof(struct packet) + amount;
 
-    if ((_heap_usage + pdu_len) > MBED_CONF_ESP8266_SOCKET_BUFSIZE) {
+    // Application not reading, switch to passive before the buffer overflows. AT commands
+    // can't be given from a handler, see _process_oob.
+    if (_tcp_adaptive && !_tcp_passive && _heap_usage + pdu_len >= ESP8266_TCP_PASSIVE_HIGH_WATERMARK) {
+        _tcp_mode_check = true;
+    }
+
+    if ((uint32_t)amount > _rx_room(id)) {
         MBED_WARNING(MBED_MAKE_ERROR(MBED_MODULE_DRIVER, MBED_ERROR_CODE_ENOBUFS), \
                 "ESP8266::_packet_handler(): \"esp8266.socket-bufsize\"-limit exceeded, packet dropped");
+        _discard(amount);
         return;
     }
 
@@ -562,11 +1155,15 @@ void ESP8266::_oob_packet_hdlr()
     if (!packet) {
         MBED_WARNING(MBED_MAKE_ERROR(MBED_MODULE_DRIVER, MBED_ERROR_CODE_ENOMEM), \
                 "ESP8266::_packet_handler(): Could not allocate memory for RX data");
+        _discard(amount);
         return;
     }
     _heap_usage += pdu_len;
 
     packet->id = id;
+    packet->gen = _sock_i[id].gen;
+    strcpy(packet->remote_ip, ip);
+    packet->remote_port = port;
     packet->len = amount;
     packet->alloc_len = amount;
     packet->next = 0;
@@ -580,157 +1177,746 @@ void ESP8266::_oob_packet_hdlr()
     // append to packet list
     *_packets_end = packet;
     _packets_end = &packet->next;
-}
+    _sock_i[id].rx_buffered += amount;
+    _sock_i[id].rx_packets++;
 
-void ESP8266::_process_oob(uint32_t timeout, bool all) {
-    set_timeout(timeout);
-    // Poll for inbound packets
-    while (_parser.process_oob() && all) {
+    _sock_event(id);
+    if (_sock_i[id].any_remote) {
+        // Readiness of the link may not change, readers of other remote ends wait for this one
+        _sock_ready_cond.notify_all();
     }
-    set_timeout();
 }
 
-int32_t ESP8266::_recv_tcp_passive(int id, void *data, uint32_t amount, uint32_t timeout)
+bool ESP8266::_recv_ipd_len(bool passive, int *amount, char *ip, int *port)
 {
-    int32_t len;
-    int32_t ret = (int32_t)NSAPI_ERROR_WOULD_BLOCK;
+    char term;
 
-    // No flow control, drain the USART receive register ASAP to avoid data overrun
-    if (_serial_rts == NC) {
-        _process_oob(timeout, true);
+    // +IPD,<id>,<len>[,<remote IP>,<remote port>]:, sender only with AT+CIPDINFO=1
+    if (!_parser.recv("%d%c", amount, &term)) {
+        return false;
+    }
+    if (term == ',') {
+        return passive ? _parser.recv("%15[^,],%d\n", ip, port) : _parser.recv("%15[^,],%d:", ip, port);
+    }
+    return true;
+}
+
+void ESP8266::_discard(int amount)
+{
+    char buf[32];
+
+    // Keep data that has no place to go from being parsed as AT responses
+    while (amount > 0) {
+        int len = amount < (int)sizeof(buf) ? amount : sizeof(buf);
+        if (_parser.read(buf, len) < len) {
+            return;
+        }
+        amount -= len;
     }
+}
 
+void ESP8266::bg_process_oob(uint32_t timeout, bool all)
+{
     _smutex.lock();
+    _process_oob(timeout, all);
+    _smutex.unlock();
+}
 
+void ESP8266::_process_oob(uint32_t timeout, bool all) {
+    // Caller holds _smutex, handlers wake up waiters on _sock_ready_cond
+
+    // process_oob would drop scan's or join's final OK
+    if (_scan_active) {
+        _scan_poll(timeout < ESP8266_SCAN_POLL_TIMEOUT ? timeout : ESP8266_SCAN_POLL_TIMEOUT);
+        return;
+    }
+    if (_join_active) {
+        _join_poll(timeout < ESP8266_SCAN_POLL_TIMEOUT ? timeout : ESP8266_SCAN_POLL_TIMEOUT);
+        return;
+    }
+
+    set_timeout(timeout);
+    // Poll for inbound packets
+    while (_parser.process_oob() && all && !_tcp_mode_check) {
+    }
+    set_timeout();
+
+    if (_tcp_mode_check) {
+        _tcp_mode_check = false;
+        _adapt_tcp_recv_mode();
+    }
+}
+
+int32_t ESP8266::_prefetch_tcp_passive(int id, uint32_t amount)
+{
+    int32_t len;
+
+    // Fetch only what fits the socket's share
+    uint32_t room = _rx_room(id);
+    if (room == 0) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+    if (amount > room) {
+        amount = room;
+    }
+    int pdu_len = sizeof(struct packet) + amount;
+
+    struct packet *packet = (struct packet*)malloc(pdu_len);
+    if (!packet) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    _scan_wait();
     // NOTE: documentation v3.0 says '+CIPRECVDATA:<data_len>,' but it's not how the FW responds...
     bool done = _parser.send("AT+CIPRECVDATA=%d,%lu", id, amount)
         && _parser.recv("+CIPRECVDATA,%ld:", &len)
-        && _parser.read((char*)data, len)
+        && len <= (int32_t)amount
+        && (len == 0 || _parser.read((char*)(packet + 1), len))
         && _parser.recv("OK\n");
 
-    if (done) {
-        _smutex.unlock();
-        return len;
+    if (!done) {
+        free(packet);
+        return NSAPI_ERROR_DEVICE_ERROR;
     }
 
-    // Socket closed, doesn't mean there couldn't be data left
-    if (!_sock_i[id].open) {
-        done = _parser.send("AT+CIPRECVDATA=%d,%lu", id, amount)
-            && _parser.recv("+CIPRECVDATA,%ld:", &len)
-            && _parser.read((char*)data, len)
-            && _parser.recv("OK\n");
+    // Modem had nothing after all, announced data was read already
+    if (len == 0) {
+        free(packet);
+        _sock_i[id].tcp_data_avbl = 0;
+        return 0;
+    }
 
-        ret = done ? len : 0;
+    // Give back what modem didn't have. Data starts at alloc_len - len even if the block
+    // stays larger, see _recv_tcp_packet.
+    if ((uint32_t)len < amount) {
+        struct packet *shrunk = (struct packet*)realloc(packet, sizeof(struct packet) + len);
+        if (shrunk) {
+            packet = shrunk;
+        }
+        pdu_len = sizeof(struct packet) + len;
     }
+    _heap_usage += pdu_len;
+    _sock_i[id].tcp_data_avbl = (uint32_t)len < _sock_i[id].tcp_data_avbl ?
+        _sock_i[id].tcp_data_avbl - len : 0;
 
-    // Flow control, read from USART receive register only when no more data is buffered, and as little as possible
-    if (_serial_rts != NC) {
-        _process_oob(timeout, false);
+    packet->id = id;
+    packet->gen = _sock_i[id].gen;
+    packet->remote_ip[0] = '\0';
+    packet->remote_port = 0;
+    packet->len = len;
+    packet->alloc_len = pdu_len - sizeof(struct packet);
+    packet->next = 0;
+
+    *_packets_end = packet;
+    _packets_end = &packet->next;
+    _sock_i[id].rx_buffered += len;
+    _sock_i[id].rx_packets++;
+
+    return len;
+}
+
+void ESP8266::_schedule_tcp_passive()
+{
+    // Deficit round robin over the sockets with data waiting on modem. Each round a socket earns
+    // its weight worth of quantums and may fetch that much, so busy sockets share the link in
+    // proportion to their weights and none of them is left to fill up modem's memory.
+    int contending = 0;
+    for (int id = 0; id < SOCKET_COUNT; id++) {
+        if (_sock_i[id].proto == NSAPI_TCP && _sock_i[id].tcp_data_avbl
+                && _sock_i[id].rx_buffered < MBED_CONF_ESP8266_TCP_PREFETCH_SIZE) {
+            contending++;
+        }
     }
+
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        int id = (_tcp_sched_next + i) % SOCKET_COUNT;
+        struct _sock_info *sock = &_sock_i[id];
+
+        if (sock->proto != NSAPI_TCP || sock->tcp_data_avbl == 0) {
+            sock->tcp_deficit = 0;
+            continue;
+        }
+        // Application not keeping up, leave the rest on modem
+        if (sock->rx_buffered >= MBED_CONF_ESP8266_TCP_PREFETCH_SIZE) {
+            continue;
+        }
+
+        // Alone on the link, all it has is fetched in one exchange
+        uint32_t amount = sock->tcp_data_avbl;
+        if (contending > 1) {
+            sock->tcp_deficit += sock->tcp_weight * ESP8266_TCP_SCHED_QUANTUM;
+            amount = amount < sock->tcp_deficit ? amount : sock->tcp_deficit;
+        }
+        if (amount > MBED_CONF_ESP8266_TCP_PREFETCH_SIZE - sock->rx_buffered) {
+            amount = MBED_CONF_ESP8266_TCP_PREFETCH_SIZE - sock->rx_buffered;
+        }
+
+        int32_t len = _prefetch_tcp_passive(id, amount);
+        if (len == NSAPI_ERROR_NO_MEMORY) {
+            break; // Socket data buffer full, continue from here next round
+        } else if (len < 0) {
+            continue;
+        }
+
+        sock->tcp_deficit = sock->tcp_data_avbl && contending > 1 ? sock->tcp_deficit - len : 0;
+        if (len > 0) {
+            _sock_event(id);
+        }
+    }
+    _tcp_sched_next = (_tcp_sched_next + 1) % SOCKET_COUNT;
+}
+
+bool ESP8266::set_tcp_weight(int id, uint8_t weight)
+{
+    if (id < 0 || id >= SOCKET_COUNT || weight < 1 || weight > ESP8266_TCP_SCHED_WEIGHT_MAX) {
+        return false;
+    }
+
+    _smutex.lock();
+    _sock_i[id].tcp_weight = weight;
     _smutex.unlock();
-    return ret;
+
+    return true;
 }
 
-int32_t ESP8266::recv_tcp(int id, void *data, uint32_t amount, uint32_t timeout)
+bool ESP8266::set_rcvbuf(int id, uint32_t size)
 {
-    if (_tcp_passive) {
-        return _recv_tcp_passive(id, data, amount, timeout);
+    if (id < 0 || id >= SOCKET_COUNT) {
+        return false;
     }
 
+    _smutex.lock();
+    uint32_t reserved = size;
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (i != id) {
+            reserved += _sock_i[i].rcvbuf;
+        }
+    }
+    // Leave sockets without a reservation room to work in
+    bool done = reserved <= ESP8266_RCVBUF_RESERVABLE;
+    if (done) {
+        _sock_i[id].rcvbuf = size;
+    }
+    _smutex.unlock();
+
+    return done;
+}
+
+uint32_t ESP8266::_rx_room(int id)
+{
+    uint32_t limit = MBED_CONF_ESP8266_SOCKET_BUFSIZE;
+
+    // Unused reservations of other sockets are off limits
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (i != id && _sock_i[i].rcvbuf > _sock_i[i].rx_buffered) {
+            limit -= _sock_i[i].rcvbuf - _sock_i[i].rx_buffered;
+        }
+    }
+
+    uint32_t room = _heap_usage + sizeof(struct packet) < limit ?
+        limit - _heap_usage - sizeof(struct packet) : 0;
+
+    // Socket's own limit
+    if (_sock_i[id].rcvbuf) {
+        uint32_t own = _sock_i[id].rcvbuf > _sock_i[id].rx_buffered ?
+            _sock_i[id].rcvbuf - _sock_i[id].rx_buffered : 0;
+        room = own < room ? own : room;
+    }
+
+    return room;
+}
+
+int32_t ESP8266::_recv_tcp_passive(int id, void *data, uint32_t amount)
+{
+    int32_t len;
+    int32_t ret = (int32_t)NSAPI_ERROR_WOULD_BLOCK;
+
+    // OOB handlers signal _sock_ready_cond and share the parser with the driver thread
     _smutex.lock();
 
     // No flow control, drain the USART receive register ASAP to avoid data overrun
     if (_serial_rts == NC) {
-        _process_oob(timeout, true);
+        _process_oob(ESP8266_RECV_TIMEOUT, true);
     }
 
-    // check if any packets are ready for us
+    // Serve small reads from what has been read ahead
+    len = _recv_tcp_packet(id, data, amount);
+    if (len != NSAPI_ERROR_WOULD_BLOCK) {
+        _smutex.unlock();
+        return len;
+    }
+
+    // Ask for data only if modem has announced some with +IPD, empty polls would cost a full AT round trip
+    if (_sock_i[id].tcp_data_avbl != 0) {
+        // Reads at least the size of the read-ahead go straight to application's buffer, as nothing
+        // is buffered for the socket. Others fetch for every socket with data waiting in fair order,
+        // not only for whoever got the lock first.
+        if (amount < MBED_CONF_ESP8266_TCP_PREFETCH_SIZE) {
+            _schedule_tcp_passive();
+
+            len = _recv_tcp_packet(id, data, amount);
+            if (len != NSAPI_ERROR_WOULD_BLOCK) {
+                _smutex.unlock();
+                return len;
+            }
+        }
+
+        // Large read, or nothing fetched for this socket as socket data buffer is full. Read
+        // directly to application.
+
+        _scan_wait();
+        // NOTE: documentation v3.0 says '+CIPRECVDATA:<data_len>,' but it's not how the FW responds...
+        bool done = _parser.send("AT+CIPRECVDATA=%d,%lu", id, amount)
+            && _parser.recv("+CIPRECVDATA,%ld:", &len)
+            && (len == 0 || _parser.read((char*)data, len))
+            && _parser.recv("OK\n");
+
+        if (done) {
+            // Modem had nothing after all, announced data was read already
+            _sock_i[id].tcp_data_avbl = len && (uint32_t)len < _sock_i[id].tcp_data_avbl ?
+                _sock_i[id].tcp_data_avbl - len : 0;
+            _update_ready(id);
+            if (len > 0) {
+                _smutex.unlock();
+                return len;
+            }
+        }
+    } else if (!_sock_i[id].open) {
+        // Socket closed and all its data read
+        _smutex.unlock();
+        return _sock_i[id].lost ? NSAPI_ERROR_CONNECTION_LOST : 0;
+    }
+
+    // Flow control, read from USART receive register only when no more data is buffered, and as little as possible
+    if (_serial_rts != NC) {
+        _process_oob(ESP8266_RECV_TIMEOUT, false);
+    }
+    _smutex.unlock();
+    return ret;
+}
+
+int32_t ESP8266::_recv_tcp_packet(int id, void *data, uint32_t amount)
+{
     for (struct packet **p = &_packets; *p; p = &(*p)->next) {
-        if ((*p)->id == id) {
+        if ((*p)->id == id && (*p)->gen == _sock_i[id].gen) {
             struct packet *q = *p;
+            // Data consumed by earlier partial reads is skipped, not moved
+            uint8_t *pdu = (uint8_t*)(q+1) + (q->alloc_len - q->len);
 
             if (q->len <= amount) { // Return and remove full packet
-                memcpy(data, q+1, q->len);
+                memcpy(data, pdu, q->len);
 
                 if (_packets_end == &(*p)->next) {
                     _packets_end = p;
                 }
                 *p = (*p)->next;
 
-                _smutex.unlock();
-
                 uint32_t pdu_len = sizeof(struct packet) + q->alloc_len;
                 uint32_t len = q->len;
                 free(q);
                 _heap_usage -= pdu_len;
+                _sock_i[id].rx_buffered -= len;
+                _sock_i[id].rx_packets--;
+                _update_ready(id);
                 return len;
             } else { // return only partial packet
-                memcpy(data, q+1, amount);
-
+                memcpy(data, pdu, amount);
                 q->len -= amount;
-                memmove(q+1, (uint8_t*)(q+1) + amount, q->len);
-
-                _smutex.unlock();
+                _sock_i[id].rx_buffered -= amount;
                 return amount;
             }
         }
     }
+
+    return NSAPI_ERROR_WOULD_BLOCK;
+}
+
+int32_t ESP8266::_recv_tcp(int id, void *data, uint32_t amount)
+{
+    int32_t len;
+
+    _smutex.lock();
+    _adapt_tcp_recv_mode();
+    if (_tcp_passive) {
+        _smutex.unlock();
+        return _recv_tcp_passive(id, data, amount);
+    }
+
+    // No flow control, drain the USART receive register ASAP to avoid data overrun
+    if (_serial_rts == NC) {
+        _process_oob(ESP8266_RECV_TIMEOUT, true);
+    }
+
+    // check if any packets are ready for us
+    len = _recv_tcp_packet(id, data, amount);
+    if (len != NSAPI_ERROR_WOULD_BLOCK) {
+        _smutex.unlock();
+        return len;
+    }
+
     if(!_sock_i[id].open) {
         _smutex.unlock();
-        return 0;
+        return _sock_i[id].lost ? NSAPI_ERROR_CONNECTION_LOST : 0;
     }
 
     // Flow control, read from USART receive register only when no more data is buffered, and as little as possible
     if (_serial_rts != NC) {
-        _process_oob(timeout, false);
+        _process_oob(ESP8266_RECV_TIMEOUT, false);
     }
     _smutex.unlock();
 
     return NSAPI_ERROR_WOULD_BLOCK;
 }
 
-int32_t ESP8266::recv_udp(int id, void *data, uint32_t amount, uint32_t timeout)
+int32_t ESP8266::_recv_udp(int id, void *data, uint32_t amount)
 {
     _smutex.lock();
-    set_timeout(timeout);
+    _adapt_tcp_recv_mode();
 
     // No flow control, drain the USART receive register ASAP to avoid data overrun
     if (_serial_rts == NC) {
-        _process_oob(timeout, true);
+        _process_oob(ESP8266_RECV_TIMEOUT, true);
     }
 
-    set_timeout();
-
     // check if any packets are ready for us
+    struct packet **p = _packet_find(id, 0, 0);
+    if (p) {
+        uint32_t len = _packet_take(p, data, amount);
+        _smutex.unlock();
+        return len;
+    }
+
+    if (_sock_i[id].lost) {
+        _smutex.unlock();
+        return NSAPI_ERROR_CONNECTION_LOST;
+    }
+
+    // Flow control, read from USART receive register only when no more data is buffered, and as little as possible
+    if (_serial_rts != NC) {
+        _process_oob(ESP8266_RECV_TIMEOUT, false);
+    }
+
+    _smutex.unlock();
+
+    return NSAPI_ERROR_WOULD_BLOCK;
+}
+
+int32_t ESP8266::recv_tcp(int id, void *data, uint32_t amount, uint32_t timeout)
+{
+    return _recv_wait(id, data, amount, timeout, &ESP8266::_recv_tcp);
+}
+
+int32_t ESP8266::recv_udp(int id, void *data, uint32_t amount, uint32_t timeout)
+{
+    return _recv_wait(id, data, amount, timeout, &ESP8266::_recv_udp);
+}
+
+int32_t ESP8266::recv_udp_from(int id, const char *addr, int port, void *data, uint32_t amount,
+                               uint32_t timeout, uint32_t *full_len)
+{
+    uint64_t start = rtos::Kernel::get_ms_count();
+
+    _smutex.lock();
+    while (true) {
+        int32_t ret = _recv_udp_from(id, addr, port, data, amount);
+        uint64_t elapsed = rtos::Kernel::get_ms_count() - start;
+        if (ret != NSAPI_ERROR_WOULD_BLOCK || elapsed >= timeout) {
+            if (ret >= 0 && full_len) {
+                *full_len = _sock_i[id].rx_full_len;
+            }
+            _smutex.unlock();
+            return ret;
+        }
+        // Link is shared, wait for any new datagram, see _oob_packet_hdlr
+        _sock_ready_cond.wait_for(timeout - elapsed);
+    }
+}
+
+int32_t ESP8266::_recv_udp_from(int id, const char *addr, int port, void *data, uint32_t amount)
+{
+    struct packet **p = _packet_find(id, addr, port);
+    if (p) {
+        return _packet_take(p, data, amount);
+    }
+
+    return _sock_i[id].lost ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_WOULD_BLOCK;
+}
+
+struct ESP8266::packet **ESP8266::_packet_find(int id, const char *addr, int port)
+{
     for (struct packet **p = &_packets; *p; p = &(*p)->next) {
-        if ((*p)->id == id) {
-            struct packet *q = *p;
+        struct packet *q = *p;
+        if (q->id == id && q->gen == _sock_i[id].gen
+                && (!addr || (q->remote_port == port && strcmp(q->remote_ip, addr) == 0))) {
+            return p;
+        }
+    }
 
-            // Return and remove packet (truncated if necessary)
-            uint32_t len = q->len < amount ? q->len : amount;
-            memcpy(data, q+1, len);
+    return 0;
+}
 
-            if (_packets_end == &(*p)->next) {
-                _packets_end = p;
+uint32_t ESP8266::_packet_take(struct packet **p, void *data, uint32_t amount)
+{
+    struct packet *q = *p;
+    int id = q->id;
+
+    // Return and remove packet (truncated if necessary)
+    uint32_t len = q->len < amount ? q->len : amount;
+    memcpy(data, q+1, len);
+    _sock_i[id].rx_full_len = q->len;
+
+    if (_packets_end == &(*p)->next) {
+        _packets_end = p;
+    }
+    *p = (*p)->next;
+
+    _sock_i[id].rx_buffered -= q->len;
+    _sock_i[id].rx_packets--;
+    _heap_usage -= sizeof(struct packet) + q->alloc_len;
+    free(q);
+    _update_ready(id);
+
+    return len;
+}
+
+int ESP8266::recv_udp_batch(int id, struct udp_datagram *msgs, unsigned count, uint32_t timeout,
+                            const char *addr, int port)
+{
+    uint64_t start = rtos::Kernel::get_ms_count();
+    unsigned n = 0;
+
+    _smutex.lock();
+    while (true) {
+        // No flow control, drain the USART receive register ASAP to avoid data overrun
+        if (_serial_rts == NC) {
+            _process_oob(ESP8266_RECV_TIMEOUT, true);
+        }
+
+        struct packet **p;
+        while (n < count && (p = _packet_find(id, addr, port))) {
+            _packet_take(p, msgs[n].data, msgs[n].size);
+            msgs[n].len = _sock_i[id].rx_full_len;
+            n++;
+        }
+
+        uint64_t elapsed = rtos::Kernel::get_ms_count() - start;
+        if (n || count == 0 || _sock_i[id].lost || elapsed >= timeout) {
+            break;
+        }
+        // Woken up by a new datagram, see _oob_packet_hdlr
+        _sock_ready_cond.wait_for(timeout - elapsed);
+    }
+    bool lost = _sock_i[id].lost;
+    _smutex.unlock();
+
+    if (n) {
+        return n;
+    }
+    return lost ? NSAPI_ERROR_CONNECTION_LOST : NSAPI_ERROR_WOULD_BLOCK;
+}
+
+int32_t ESP8266::rx_next_len(int id, const char *addr, int port)
+{
+    _smutex.lock();
+    struct packet **p = _packet_find(id, addr, port);
+    int32_t len = p ? (int32_t)(*p)->len : NSAPI_ERROR_WOULD_BLOCK;
+    _smutex.unlock();
+
+    return len;
+}
+
+uint32_t ESP8266::rx_full_len(int id)
+{
+    _smutex.lock();
+    uint32_t len = _sock_i[id].rx_full_len;
+    _smutex.unlock();
+
+    return len;
+}
+
+int32_t ESP8266::_recv_wait(int id, void *data, uint32_t amount, uint32_t timeout,
+                            int32_t (ESP8266::*recv)(int, void *, uint32_t))
+{
+    uint64_t start = rtos::Kernel::get_ms_count();
+    bool waited = false;
+
+    while (true) {
+        // Cleared before looking for data, an event after this wakes up the wait below
+        _sock_evt_flags.clear(1 << id);
+
+        int32_t ret = (this->*recv)(id, data, amount);
+        if (ret != NSAPI_ERROR_WOULD_BLOCK) {
+            if (waited) {
+                _smutex.lock();
+                _wakeup_stats_update(id, false);
+                _smutex.unlock();
+            }
+            return ret;
+        }
+
+        uint64_t elapsed = rtos::Kernel::get_ms_count() - start;
+        if (elapsed >= timeout) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+
+        // Offer the buffer to OOB processing, see _oob_packet_hdlr
+        _smutex.lock();
+        bool offered = amount && !_sock_i[id].rx_wait_buf && _sock_i[id].rx_packets == 0;
+        if (offered) {
+            _sock_i[id].rx_wait_buf = data;
+            _sock_i[id].rx_wait_len = amount;
+            _sock_i[id].rx_placed = -1;
+        }
+        _smutex.unlock();
+
+        // Sleep until OOB processing has something for this socket
+        _sock_evt_flags.wait_any(1 << id, timeout - elapsed);
+        waited = true;
+
+        if (offered) {
+            _smutex.lock();
+            _sock_i[id].rx_wait_buf = 0;
+            int32_t placed = _sock_i[id].rx_placed;
+            if (placed >= 0) {
+                _wakeup_stats_update(id, true);
+                _smutex.unlock();
+                return placed;
             }
-            *p = (*p)->next;
             _smutex.unlock();
+        }
+    }
+}
 
-            uint32_t pdu_len = sizeof(struct packet) + q->alloc_len;
-            free(q);
-            _heap_usage -= pdu_len;
-            return len;
+void ESP8266::_wakeup_stats_update(int id, bool placed)
+{
+    uint32_t latency = us_ticker_read() - _sock_i[id].event_us;
+
+    _recv_wakeup_stats.wakeups++;
+    if (placed) {
+        _recv_wakeup_stats.placed++;
+    }
+    _recv_wakeup_stats.latency_last_us = latency;
+    if (latency > _recv_wakeup_stats.latency_max_us) {
+        _recv_wakeup_stats.latency_max_us = latency;
+    }
+}
+
+struct ESP8266::wakeup_stats ESP8266::recv_wakeup_stats()
+{
+    _smutex.lock();
+    struct wakeup_stats stats = _recv_wakeup_stats;
+    _smutex.unlock();
+
+    return stats;
+}
+
+void ESP8266::_sock_event(int id)
+{
+    _sock_i[id].event_us = us_ticker_read();
+    _update_ready(id);
+    _sock_evt_flags.set(1 << id);
+
+    if (_sock_sigio_cb) {
+        _sock_sigio_cb(id);
+    }
+}
+
+bool ESP8266::tcp_reusable(int id)
+{
+    _smutex.lock();
+    bool reusable = _sock_i[id].open && _sock_i[id].proto == NSAPI_TCP && !_sock_i[id].hup
+                    && !_sock_i[id].rx_buffered && !_sock_i[id].tcp_data_avbl;
+    _smutex.unlock();
+
+    return reusable;
+}
+
+uint32_t ESP8266::rx_buffered(int id)
+{
+    _smutex.lock();
+    uint32_t bytes = _sock_i[id].rx_buffered;
+    _smutex.unlock();
+
+    return bytes;
+}
+
+uint32_t ESP8266::rx_datagrams(int id)
+{
+    _smutex.lock();
+    uint32_t count = _sock_i[id].rx_packets;
+    _smutex.unlock();
+
+    return count;
+}
+
+int32_t ESP8266::tcp_pending(int id)
+{
+    int32_t len[SOCKET_COUNT];
+
+    if (!_tcp_passive) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+
+    _smutex.lock();
+    _scan_wait();
+    bool done = _parser.send("AT+CIPRECVLEN?")
+        && _parser.recv("+CIPRECVLEN:%ld,%ld,%ld,%ld,%ld", &len[0], &len[1], &len[2], &len[3], &len[4])
+        && _parser.recv("OK\n");
+
+    if (!done) {
+        _smutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    // Modem's count is the accurate one, +IPD notifications may have been missed
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (_sock_i[i].proto == NSAPI_TCP && len[i] >= 0) {
+            _sock_i[i].tcp_data_avbl = len[i];
+            _update_ready(i);
         }
     }
+    _smutex.unlock();
 
-    // Flow control, read from USART receive register only when no more data is buffered, and as little as possible
-    if (_serial_rts != NC) {
-        _process_oob(timeout, false);
+    return len[id] > 0 ? len[id] : 0;
+}
+
+void ESP8266::_update_ready(int id)
+{
+    uint32_t events = 0;
+
+    if (_sock_i[id].rx_buffered || _sock_i[id].tcp_data_avbl) {
+        events |= POLLIN;
+    }
+    if (_sock_i[id].open) {
+        events |= POLLOUT;
+    }
+    if (_sock_i[id].hup) {
+        events |= POLLHUP;
     }
 
+    uint32_t ready = (_sock_ready & ~poll_mask(id, POLLIN | POLLOUT | POLLHUP)) | poll_mask(id, events);
+    if (ready != _sock_ready) {
+        _sock_ready = ready;
+        _sock_ready_cond.notify_all();
+    }
+}
+
+uint32_t ESP8266::poll(uint32_t interest, uint32_t timeout)
+{
+    uint64_t start = rtos::Kernel::get_ms_count();
+
+    _smutex.lock();
+    while (!(_sock_ready & interest)) {
+        uint64_t elapsed = rtos::Kernel::get_ms_count() - start;
+        if (elapsed >= timeout) {
+            break;
+        }
+        _sock_ready_cond.wait_for(timeout - elapsed);
+    }
+    uint32_t ready = _sock_ready & interest;
     _smutex.unlock();
 
-    return NSAPI_ERROR_WOULD_BLOCK;
+    return ready;
 }
 
 void ESP8266::_clear_socket_packets(int id)
@@ -746,6 +1932,8 @@ void ESP8266::_clear_socket_packets(int id)
                 _packets_end = p; // Set last packet next field/_packets
             }
             *p = (*p)->next;
+            _sock_i[q->id].rx_buffered -= q->len;
+            _sock_i[q->id].rx_packets--;
             free(q);
             _heap_usage -= pdu_len;
         } else {
@@ -753,18 +1941,97 @@ void ESP8266::_clear_socket_packets(int id)
             p = &(*p)->next;
         }
     }
+
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (i == id || id == ESP8266_ALL_SOCKET_IDS) {
+            _update_ready(i);
+        }
+    }
+}
+
+int ESP8266::sync_sockets(int keep)
+{
+    char line[64];
+    int live = 0;
+    bool done = false;
+
+    _smutex.lock();
+    _scan_wait();
+
+    // One line per link, e.g. +CIPSTATUS:0,"TCP","192.168.1.2",80,4372,0
+    if (_parser.send("AT+CIPSTATUS")) {
+        while (!done && _parser.recv("%63[^\r]%*[\r]%*[\n]", line)) {
+            int link;
+            if (sscanf(line, "+CIPSTATUS:%d,", &link) == 1) {
+                if (link >= 0 && link < SOCKET_COUNT) {
+                    live |= 1 << link;
+                }
+            } else if (strcmp(line, "OK") == 0) {
+                done = true;
+            } else if (strcmp(line, "ERROR") == 0) {
+                break;
+            }
+        }
+    }
+
+    if (!done) {
+        _smutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        bool up = live & (1 << i);
+
+        if (_sock_i[i].open && !up) {
+            // Closed without us noticing
+            _sock_i[i].open = false;
+            _sock_i[i].tcp_data_avbl = 0;
+            _sock_i[i].hup = true;
+            _sock_event(i);
+        } else if (up && (!_sock_i[i].open || !(keep & (1 << i)))) {
+            // Nobody owns the link, it would only block the id
+            if (!_parser.send("AT+CIPCLOSE=%d", i) || !_parser.recv("OK\n")) {
+                continue;
+            }
+            _sock_i[i].open = false;
+            _sock_i[i].tcp_data_avbl = 0;
+            _clear_socket_packets(i);
+            live &= ~(1 << i);
+        }
+    }
+
+    _smutex.unlock();
+
+    return live;
 }
 
 bool ESP8266::close(int id)
 {
+    // Link vanished with modem's reset, nothing to close on modem's side
+    if (_sock_i[id].lost) {
+        _smutex.lock();
+        _sock_i[id].lost = false;
+        _sock_i[id].hup = false;
+        _clear_socket_packets(id);
+        _smutex.unlock();
+        return true;
+    }
+
     //May take a second try if device is busy
     for (unsigned i = 0; i < 2; i++) {
         _smutex.lock();
+        _scan_wait();
+        _closed = false;
         if (_parser.send("AT+CIPCLOSE=%d", id)) {
             if (!_parser.recv("OK\n")) {
-                if (_closed) { // UNLINK ERROR
-                    _closed = false;
+                // UNLINK ERROR, can't be pinpointed to a socket so ask modem which links are up
+                int live = _closed ? sync_sockets() : -1;
+                _closed = false;
+                if (live >= 0 && !(live & (1 << id))) {
                     _sock_i[id].open = false;
+                    _sock_i[id].tcp_data_avbl = 0;
+                    _sock_i[id].hup = false;
+                    _sock_i[id].lost = false;
                     _clear_socket_packets(id);
                     _smutex.unlock();
                     // ESP8266 has a habit that it might close a socket on its own.
@@ -772,6 +2039,9 @@ bool ESP8266::close(int id)
                 }
             } else {
                 // _sock_i[id].open set to false with an OOB
+                _sock_i[id].tcp_data_avbl = 0;
+                _sock_i[id].hup = false;
+                _sock_i[id].lost = false;
                 _clear_socket_packets(id);
                 _smutex.unlock();
                 return true;
@@ -803,6 +2073,11 @@ void ESP8266::sigio(Callback<void()> func)
     _serial.sigio(func);
 }
 
+void ESP8266::socket_sigio(Callback<void(int)> func)
+{
+    _sock_sigio_cb = func;
+}
+
 void ESP8266::attach(Callback<void()> status_cb)
 {
     _conn_stat_cb = status_cb;
@@ -810,32 +2085,103 @@ void ESP8266::attach(Callback<void()> status_cb)
 
 bool ESP8266::_recv_ap(nsapi_wifi_ap_t *ap)
 {
-    int sec;
-    int dummy;
-    bool ret = _parser.recv("+CWLAP:(%d,\"%32[^\"]\",%hhd,\"%hhx:%hhx:%hhx:%hhx:%hhx:%hhx\",%hhu,%d,%d)\n",
-            &sec,
-            ap->ssid,
-            &ap->rssi,
-            &ap->bssid[0], &ap->bssid[1], &ap->bssid[2], &ap->bssid[3], &ap->bssid[4], &ap->bssid[5],
-            &ap->channel,
-            &dummy,
-            &dummy);
+    char line[128];
+    int sec = NSAPI_SECURITY_UNKNOWN;
+
+    if (!_parser.recv("%127[^\r]%*[\r]%*[\n]", line) || line[0] != '(') {
+        return false;
+    }
+    memset(ap, 0, sizeof(*ap));
+
+    // Only fields selected with AT+CWLAPOPT are present, in this order, e.g.
+    // (3,"ssid",-60,"aa:bb:cc:dd:ee:ff",6,-13,0)
+    const char *p = line + 1;
+    for (int field = 0; field <= SCAN_CHANNEL_BIT; field++) {
+        if (!(_scan_mask & (1 << field))) {
+            continue;
+        }
 
-    ap->security = sec < 5 ? (nsapi_security_t)sec : NSAPI_SECURITY_UNKNOWN;
+        int n = 0;
+        if (field == SCAN_ECN_BIT) {
+            sscanf(p, "%d%n", &sec, &n);
+        } else if (field == SCAN_SSID_BIT) {
+            const char *end = *p == '"' ? strchr(p + 1, '"') : 0;
+            if (end) {
+                int len = end - p - 1 < 32 ? end - p - 1 : 32;
+                memcpy(ap->ssid, p + 1, len);
+                ap->ssid[len] = 0;
+                n = end - p + 1;
+            }
+        } else if (field == SCAN_RSSI_BIT) {
+            sscanf(p, "%hhd%n", &ap->rssi, &n);
+        } else if (field == SCAN_MAC_BIT) {
+            sscanf(p, "\"%hhx:%hhx:%hhx:%hhx:%hhx:%hhx\"%n", &ap->bssid[0], &ap->bssid[1], &ap->bssid[2],
+                   &ap->bssid[3], &ap->bssid[4], &ap->bssid[5], &n);
+        } else {
+            sscanf(p, "%hhu%n", &ap->channel, &n);
+        }
 
-    return ret;
+        if (n == 0) {
+            return false;
+        }
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    ap->security = sec >= 0 && sec < 5 ? (nsapi_security_t)sec : NSAPI_SECURITY_UNKNOWN;
+
+    return true;
 }
 
 void ESP8266::_oob_watchdog_reset()
 {
     for (int i = 0; i < SOCKET_COUNT; i++) {
-        _sock_i[i].open = false;
+        if (_sock_i[i].open) {
+            _sock_i[i].open = false;
+            _sock_i[i].hup = true;
+            _sock_i[i].lost = true; // Not closed by remote end, tell it apart
+        }
+        _sock_i[i].tcp_data_avbl = 0;
+        _sock_event(i);
+    }
+
+    // Modem is back with its defaults, active TCP receive mode among them
+    _tcp_passive = false;
+    _dinfo = false;
+    _ssl_bufsize_set = false;
+    _scan_opts_set = false;
+    _wdt_reset = true;
+
+    if (_scan_active) {
+        _scan_end(NSAPI_ERROR_DEVICE_ERROR);
+    }
+    if (_join_active) {
+        _join_end(NSAPI_ERROR_DEVICE_ERROR);
     }
 
     _conn_status = NSAPI_STATUS_DISCONNECTED;
     _conn_stat_cb();
 }
 
+void ESP8266::_oob_scan_result()
+{
+    nsapi_wifi_ap_t ap;
+
+    if (!_recv_ap(&ap)) {
+        return;
+    }
+
+    _scan_count++;
+    _scan_rssi = ap.rssi;
+    _scan_cache_add(&ap);
+    if (_scan_cb) {
+        WiFiAccessPoint res(ap);
+        _scan_cb(&res, NSAPI_ERROR_OK);
+    }
+}
+
 void ESP8266::_oob_connect_err()
 {
     _fail = false;
@@ -871,26 +2217,36 @@ void ESP8266::_oob_socket_close_err()
 void ESP8266::_oob_socket0_closed()
 {
     _sock_i[0].open = false;
+    _sock_i[0].hup = true;
+    _sock_event(0);
 }
 
 void ESP8266::_oob_socket1_closed()
 {
     _sock_i[1].open = false;
+    _sock_i[1].hup = true;
+    _sock_event(1);
 }
 
 void ESP8266::_oob_socket2_closed()
 {
     _sock_i[2].open = false;
+    _sock_i[2].hup = true;
+    _sock_event(2);
 }
 
 void ESP8266::_oob_socket3_closed()
 {
     _sock_i[3].open = false;
+    _sock_i[3].hup = true;
+    _sock_event(3);
 }
 
 void ESP8266::_oob_socket4_closed()
 {
     _sock_i[4].open = false;
+    _sock_i[4].hup = true;
+    _sock_event(4);
 }
 
 void ESP8266::_oob_connection_status()
@@ -921,6 +2277,7 @@ int8_t ESP8266::default_wifi_mode()
     int8_t mode;
 
     _smutex.lock();
+    _scan_wait();
     if (_parser.send("AT+CWMODE_DEF?")
         && _parser.recv("+CWMODE_DEF:%hhd", &mode)
         && _parser.recv("OK\n")) {
@@ -935,6 +2292,7 @@ int8_t ESP8266::default_wifi_mode()
 bool ESP8266::set_default_wifi_mode(const int8_t mode)
 {
     _smutex.lock();
+    _scan_wait();
     bool done = _parser.send("AT+CWMODE_DEF=%hhd", mode)
                 && _parser.recv("OK\n");
     _smutex.unlock();
@@ -942,6 +2300,57 @@ bool ESP8266::set_default_wifi_mode(const int8_t mode)
     return done;
 }
 
+bool ESP8266::ap_info(char *ssid, uint8_t *bssid, int8_t *rssi)
+{
+    _smutex.lock();
+    _scan_wait();
+    set_timeout(ESP8266_MISC_TIMEOUT);
+    bool done = _parser.send("AT+CWJAP_CUR?")
+                && _parser.recv("+CWJAP_CUR:\"%32[^\"]\",\"%hhx:%hhx:%hhx:%hhx:%hhx:%hhx\",%*d,%hhd", ssid,
+                                &bssid[0], &bssid[1], &bssid[2], &bssid[3], &bssid[4], &bssid[5], rssi)
+                && _parser.recv("OK\n");
+    set_timeout();
+    _smutex.unlock();
+
+    return done;
+}
+
+bool ESP8266::drop_links()
+{
+    int open = 0;
+
+    _smutex.lock();
+    _scan_wait();
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (_sock_i[i].open) {
+            _sock_i[i].lost = true; // Not closed by remote end, tell it apart
+            open |= 1 << i;
+        }
+    }
+
+    // Id 5 closes all links
+    bool done = !open || (_parser.send("AT+CIPCLOSE=5") && _parser.recv("OK\n"));
+
+    for (int i = 0; i < SOCKET_COUNT; i++) {
+        if (open & (1 << i)) {
+            _sock_i[i].open = false;
+            _sock_i[i].hup = true;
+            _sock_i[i].tcp_data_avbl = 0;
+            _sock_event(i);
+        }
+    }
+    _smutex.unlock();
+
+    return done;
+}
+
+bool ESP8266::watchdog_reset_detected()
+{
+    bool reset = _wdt_reset;
+    _wdt_reset = false;
+    return reset;
+}
+
 nsapi_connection_status_t ESP8266::connection_status() const
 {
     return _conn_status;
@@ -34,6 +34,14 @@
 #ifndef ESP8266_MISC_TIMEOUT
 #define ESP8266_MISC_TIMEOUT    2000
 #endif
+#ifndef ESP8266_SCAN_POLL_TIMEOUT
+#define ESP8266_SCAN_POLL_TIMEOUT 100
+#endif
+
+// Access points remembered from scans, see scan_cached
+#ifndef ESP8266_SCAN_CACHE_SIZE
+#define ESP8266_SCAN_CACHE_SIZE 16
+#endif
 
 // Firmware version
 #define ESP8266_SDK_VERSION 2000000
@@ -43,6 +51,26 @@
 #define ESP8266_AT_VERSION_MAJOR ESP8266_AT_VERSION/1000000
 #define ESP8266_AT_VERSION_TCP_PASSIVE_MODE 1070000
 
+// Adaptive TCP receive mode, heap usage limits for switching between active and passive mode
+#define ESP8266_TCP_PASSIVE_HIGH_WATERMARK (MBED_CONF_ESP8266_SOCKET_BUFSIZE * 3 / 4)
+#define ESP8266_TCP_PASSIVE_LOW_WATERMARK  (MBED_CONF_ESP8266_SOCKET_BUFSIZE / 4)
+
+// Part of socket data buffer sockets can reserve for themselves, see set_rcvbuf
+#define ESP8266_RCVBUF_RESERVABLE (MBED_CONF_ESP8266_SOCKET_BUFSIZE * 3 / 4)
+
+// Passive mode TCP data fetched per scheduling round for a socket of weight one
+#define ESP8266_TCP_SCHED_QUANTUM 512
+#define ESP8266_TCP_SCHED_WEIGHT_MAX 16
+
+// Datagrams buffered on a mode 2 UDP link, oldest is dropped for a new one if unread
+#ifndef ESP8266_UDP_ANY_REMOTE_QUEUE
+#define ESP8266_UDP_ANY_REMOTE_QUEUE 16
+#endif
+
+// Modem's SSL buffer size limits, AT+CIPSSLSIZE
+#define ESP8266_SSL_BUFSIZE_MIN 2048
+#define ESP8266_SSL_BUFSIZE_MAX 4096
+
 #define FW_AT_LEAST_VERSION(MAJOR,MINOR,PATCH,NUSED/*Not used*/,REF) \
     (((MAJOR)*1000000+(MINOR)*10000+(PATCH)*100) >= REF ? true : false)
 
@@ -132,9 +160,27 @@ public:
     *
     * @param ap the name of the AP
     * @param passPhrase the password of AP
+    * @param bssid join only the access point of this BSSID, null for any of the name
     * @return NSAPI_ERROR_OK in success, negative error code in failure
     */
-    nsapi_error_t connect(const char *ap, const char *passPhrase);
+    nsapi_error_t connect(const char *ap, const char *passPhrase, const uint8_t *bssid = 0);
+
+    /**
+    * Start joining an AP
+    *
+    * Returns once AT+CWJAP_CUR is sent, @a cb gets the outcome as connect() would return it. Call is
+    * made from OOB processing, with the AT command interface held, so @a cb must not call the driver.
+    * Socket data keeps being processed during the join, commands to the modem wait for its end.
+    *
+    * @param ap the name of the AP
+    * @param passPhrase the password of AP
+    * @param bssid join only the access point of this BSSID, null for any of the name
+    * @param cb called with NSAPI_ERROR_OK once joined, negative error code on failure
+    * @return NSAPI_ERROR_OK if the join was started, NSAPI_ERROR_IN_PROGRESS if one is already
+    *         running, negative error code on failure
+    */
+    nsapi_error_t connect_async(const char *ap, const char *passPhrase, const uint8_t *bssid,
+                                mbed::Callback<void(nsapi_error_t)> cb);
 
     /**
     * Disconnect ESP8266 from AP
@@ -179,12 +225,59 @@ public:
 
     /** Scan for available networks
      *
-     * @param  ap    Pointer to allocated array to store discovered AP
-     * @param  limit Size of allocated @a res array, or 0 to only count available AP
-     * @return       Number of entries in @a res, or if @a count was 0 number of available networks, negative on error
-     *               see @a nsapi_error
+     * @param  ap      Pointer to allocated array to store discovered AP
+     * @param  limit   Size of allocated @a res array, or 0 to only count available AP
+     * @param  ssid    Only networks of this SSID, null for all
+     * @param  channel Only this channel, 0 for all
+     * @return         Number of entries in @a res, or if @a count was 0 number of available networks, negative on error
+     *                 see @a nsapi_error
+     */
+    int scan(WiFiAccessPoint *res, unsigned limit, const char *ssid = 0, uint8_t channel = 0);
+
+    /** Start scanning for available networks
+     *
+     * Returns once AT+CWLAP is sent. Each access point is passed to @a cb as soon as it is parsed,
+     * the last call has a null access point and the number of networks found, or a negative error
+     * code. Calls are made from OOB processing, with the AT command interface held, so @a cb must not
+     * call the driver. Buffered socket data stays readable during the scan, commands to the modem
+     * wait for its end.
+     *
+     * @param  cb      Called with each access point and when the scan is over
+     * @param  ssid    Only networks of this SSID, null for all
+     * @param  channel Only this channel, 0 for all
+     * @return         NSAPI_ERROR_OK if the scan was started, NSAPI_ERROR_IN_PROGRESS if a scan is
+     *                 already running, negative error code on failure
+     */
+    nsapi_error_t scan_async(mbed::Callback<void(const WiFiAccessPoint *, int)> cb, const char *ssid = 0,
+                             uint8_t channel = 0);
+
+    /** Scan for available networks, results of a recent scan are reused
+     *
+     * Every scan, including rssi's, updates the cache. Results are served from it if a full scan
+     * completed within @a max_age_ms, otherwise a scan is made as with scan.
+     *
+     * @param  res        Pointer to allocated array to store discovered AP
+     * @param  limit      Size of allocated @a res array, or 0 to only count available AP
+     * @param  max_age_ms Oldest full scan in milliseconds the results may come from
+     * @param  ssid       Only networks of this SSID, null for all
+     * @param  channel    Only this channel, 0 for all
+     * @return            Number of entries in @a res, or if @a limit was 0 number of available networks,
+     *                    negative on error
      */
-    int scan(WiFiAccessPoint *res, unsigned limit);
+    int scan_cached(WiFiAccessPoint *res, unsigned limit, uint32_t max_age_ms, const char *ssid = 0,
+                    uint8_t channel = 0);
+
+    /** Select the fields and order of scan results with AT+CWLAPOPT
+     *
+     * Fields left out are not sent by the modem, which shortens a scan in a crowded area. They read
+     * as zero, or NSAPI_SECURITY_UNKNOWN for security. Kept over a modem reset.
+     *
+     * @param  sort    true to list access points strongest first
+     * @param  mask    Bitwise or of SCAN_ECN, SCAN_SSID, SCAN_RSSI, SCAN_MAC, SCAN_CHANNEL,
+     *                 SCAN_FREQ_OFFSET and SCAN_FREQ_CAL
+     * @return         true on success
+     */
+    bool set_scan_options(bool sort, uint16_t mask);
 
     /**Perform a dns query
     *
@@ -203,9 +296,10 @@ public:
     * @param addr the IP address of the destination
     * @param port the port on the destination
     * @param local_port UDP socket's local port, zero means any
+    * @param mode 0 for fixed remote end, 2 for any remote end given on send, requires local_port
     * @return NSAPI_ERROR_OK in success, negative error code in failure
     */
-    nsapi_error_t open_udp(int id, const char* addr, int port, int local_port = 0);
+    nsapi_error_t open_udp(int id, const char* addr, int port, int local_port = 0, int mode = 0);
 
     /**
     * Open a socketed connection
@@ -216,9 +310,55 @@ public:
     * @param addr the IP address of the destination
     * @param port the port on the destination
     * @param tcp_keepalive TCP connection's keep alive time, zero means disabled
+    * @param ssl true for a connection secured by modem's SSL, see set_ssl_buffer_size
     * @return NSAPI_ERROR_OK in success, negative error code in failure
     */
-    nsapi_error_t open_tcp(int id, const char* addr, int port, int keepalive = 0);
+    nsapi_error_t open_tcp(int id, const char* addr, int port, int keepalive = 0, bool ssl = false);
+
+    /**
+    * Set size of modem's SSL buffer, AT+CIPSSLSIZE
+    *
+    * Modem supports only one SSL connection at a time. Size is given to modem before the
+    * next SSL connection is opened.
+    *
+    * @param size buffer size in bytes, 2048-4096
+    * @return true if size was valid
+    */
+    bool set_ssl_buffer_size(int size);
+
+    /**
+    * Link to open with open_tcp_each
+    *
+    * @param id id to give the new socket, valid 0-4
+    * @param addr the IP address of the destination
+    * @param port the port on the destination
+    * @param keepalive TCP connection's keep alive time, zero means disabled
+    * @param ssl true for a connection secured by modem's SSL
+    * @param result set to NSAPI_ERROR_OK in success, negative error code in failure
+    * @param ms set to time the connection took to open, in milliseconds
+    */
+    struct tcp_open {
+        int id;
+        const char *addr;
+        int port;
+        int keepalive;
+        bool ssl;
+        nsapi_error_t result;
+        uint32_t ms;
+    };
+
+    /**
+    * Open several TCP connections one after another
+    *
+    * Convenience wrapper calling open_tcp for each entry with the AT command interface held
+    * throughout. Modem answers busy to AT+CIPSTART given while it is still connecting, so handshakes
+    * are not overlapped and the total time is that of separate open_tcp calls.
+    *
+    * @param opens links to open, result of each filled in on return
+    * @param count number of entries in opens
+    * @return number of connections opened
+    */
+    int open_tcp_each(struct tcp_open *opens, unsigned count);
 
     /**
     * Sends data to an open socket
@@ -226,30 +366,227 @@ public:
     * @param id id of socket to send to
     * @param data data to be sent
     * @param amount amount of data to be sent - max 1024
+    * @param addr destination of the datagram, UDP mode 2 only, otherwise null
+    * @param port destination port of the datagram
     * @return NSAPI_ERROR_OK in success, negative error code in failure
     */
-    nsapi_error_t send(int id, const void *data, uint32_t amount);
+    nsapi_error_t send(int id, const void *data, uint32_t amount, const char *addr = 0, int port = 0);
+
+    /**
+    * Datagram to send with send_udp_batch
+    *
+    * @param data data to be sent
+    * @param len amount of data to be sent
+    * @param addr destination of the datagram, UDP mode 2 only, otherwise null
+    * @param port destination port of the datagram
+    * @param result set to NSAPI_ERROR_OK in success, negative error code in failure
+    */
+    struct udp_send {
+        const void *data;
+        uint32_t len;
+        const char *addr;
+        int port;
+        nsapi_error_t result;
+    };
+
+    /**
+    * Sends several datagrams to an open UDP socket at once
+    *
+    * AT+CIPSEND exchanges follow each other with the AT command interface held throughout. Sending
+    * stops at the first failure, datagrams after it get NSAPI_ERROR_WOULD_BLOCK as result.
+    *
+    * @param id id of socket to send to
+    * @param msgs datagrams to send
+    * @param count number of entries in msgs
+    * @return number of datagrams sent
+    */
+    int send_udp_batch(int id, struct udp_send *msgs, unsigned count);
 
     /**
     * Receives datagram from an open UDP socket
     *
+    * Sleeps until OOB processing signals data for the socket, see bg_process_oob.
+    *
     * @param id id to receive from
     * @param data placeholder for returned information
     * @param amount number of bytes to be received
-    * @return the number of bytes received
+    * @param timeout time to wait for data in milliseconds, 0 to return immediately
+    * @return the number of bytes received, NSAPI_ERROR_WOULD_BLOCK on timeout
     */
     int32_t recv_udp(int id, void *data, uint32_t amount, uint32_t timeout=ESP8266_RECV_TIMEOUT);
 
+    /**
+    * Receives datagram of given remote end from a mode 2 UDP socket
+    *
+    * Datagrams of other remote ends stay buffered for their readers.
+    *
+    * @param id id to receive from
+    * @param addr remote end's IP address
+    * @param port remote end's port
+    * @param data placeholder for returned information
+    * @param amount number of bytes to be received
+    * @param timeout time to wait for data in milliseconds, 0 to return immediately
+    * @param full_len set to datagram's length before truncation, null if not needed
+    * @return the number of bytes received, NSAPI_ERROR_WOULD_BLOCK on timeout
+    */
+    int32_t recv_udp_from(int id, const char *addr, int port, void *data, uint32_t amount,
+                          uint32_t timeout=ESP8266_RECV_TIMEOUT, uint32_t *full_len = 0);
+
+    /**
+    * Buffer for recv_udp_batch
+    *
+    * @param data placeholder for the datagram
+    * @param size size of data
+    * @param len datagram's full length, above size if truncated, set by recv_udp_batch
+    */
+    struct udp_datagram {
+        void *data;
+        uint32_t size;
+        uint32_t len;
+    };
+
+    /**
+    * Receives several datagrams from an open UDP socket at once
+    *
+    * Waits for the first datagram only, the rest are those buffered by then. All are taken with
+    * the AT command interface held once.
+    *
+    * @param id id to receive from
+    * @param msgs buffers for the datagrams, one datagram each
+    * @param count number of entries in msgs
+    * @param timeout time to wait for data in milliseconds, 0 to return immediately
+    * @param addr remote end's IP address, mode 2 UDP socket only, otherwise null
+    * @param port remote end's port
+    * @return number of datagrams received, NSAPI_ERROR_WOULD_BLOCK on timeout
+    */
+    int recv_udp_batch(int id, struct udp_datagram *msgs, unsigned count, uint32_t timeout,
+                       const char *addr = 0, int port = 0);
+
+    /**
+    * Length of the next buffered datagram of a UDP socket
+    *
+    * @param id id of the socket
+    * @param addr remote end's IP address, mode 2 UDP socket only, otherwise null
+    * @param port remote end's port
+    * @return datagram's length, NSAPI_ERROR_WOULD_BLOCK if none is buffered
+    */
+    int32_t rx_next_len(int id, const char *addr = 0, int port = 0);
+
+    /**
+    * Full length of the datagram last received from a UDP socket
+    *
+    * Above the amount returned by the receive when the datagram was truncated to the buffer.
+    *
+    * @param id id of the socket
+    * @return datagram's length
+    */
+    uint32_t rx_full_len(int id);
+
     /**
     * Receives stream data from an open TCP socket
     *
+    * Sleeps until OOB processing signals data for the socket, see bg_process_oob.
+    *
     * @param id id to receive from
     * @param data placeholder for returned information
     * @param amount number of bytes to be received
-    * @return the number of bytes received
+    * @param timeout time to wait for data in milliseconds, 0 to return immediately
+    * @return the number of bytes received, 0 if socket closed, NSAPI_ERROR_WOULD_BLOCK on timeout
     */
     int32_t recv_tcp(int id, void *data, uint32_t amount, uint32_t timeout=ESP8266_RECV_TIMEOUT);
 
+    /**
+    * Statistics of blocking receives woken up by socket data
+    *
+    * @param wakeups Receives that slept and returned with data
+    * @param placed Wakeups where OOB processing had copied the data straight to the receive buffer
+    * @param latency_last_us Time from data being signaled to it being returned, last wakeup
+    * @param latency_max_us Longest time from data being signaled to it being returned
+    */
+    struct wakeup_stats {
+        uint32_t wakeups;
+        uint32_t placed;
+        uint32_t latency_last_us;
+        uint32_t latency_max_us;
+    };
+
+    /**
+    * Get statistics of blocking receives
+    *
+    * @return wakeup_stats
+    */
+    struct wakeup_stats recv_wakeup_stats();
+
+    /**
+    * Check whether a TCP connection can be handed to a new user
+    *
+    * @param id id of socket, valid 0-4
+    * @return true if open and nothing is left to read, buffered or on modem
+    */
+    bool tcp_reusable(int id);
+
+    /**
+    * Get amount of data buffered in driver for a socket
+    *
+    * @param id id of socket, valid 0-4
+    * @return number of bytes that can be read without waiting
+    */
+    uint32_t rx_buffered(int id);
+
+    /**
+    * Get number of datagrams buffered in driver for a UDP socket
+    *
+    * @param id id of socket, valid 0-4
+    * @return number of datagrams that can be read without waiting
+    */
+    uint32_t rx_datagrams(int id);
+
+    /**
+    * Query with AT+CIPRECVLEN? how much TCP data modem holds for a socket in passive mode
+    *
+    * Also refreshes the amounts announced with +IPD for all sockets.
+    *
+    * @param id id of socket, valid 0-4
+    * @return number of bytes waiting on modem, NSAPI_ERROR_UNSUPPORTED if not in passive mode
+    */
+    int32_t tcp_pending(int id);
+
+    /**
+    * Set the share of passive mode TCP data fetched for a socket
+    *
+    * When several sockets have data waiting on the modem, it is fetched in round robin
+    * order, each socket getting amount of data in proportion to its weight.
+    *
+    * @param id id of socket, valid 0-4
+    * @param weight relative weight 1-16, default 1
+    * @return true if weight was valid
+    */
+    bool set_tcp_weight(int id, uint8_t weight);
+
+    /**
+    * Set socket's share of the socket data buffer
+    *
+    * The share is both a limit and a reservation, other sockets can't use it. Reservations
+    * together are limited to ESP8266_RCVBUF_RESERVABLE bytes of "esp8266.socket-bufsize".
+    * Data beyond the share is dropped in active mode and left on modem in passive mode.
+    *
+    * @param id id of socket, valid 0-4
+    * @param size bytes of data, 0 for no reservation and a limit of the whole unreserved buffer
+    * @return true if size could be reserved
+    */
+    bool set_rcvbuf(int id, uint32_t size);
+
+    /**
+    * Resynchronize socket table with modem's links, AT+CIPSTATUS
+    *
+    * Sockets open in the table but gone on modem are marked closed. Links up on modem but
+    * not open in the table, or not in keep, are closed on modem.
+    *
+    * @param keep mask of socket ids to keep, bit per id, all by default
+    * @return mask of links up after resynchronization, or negative error code on failure
+    */
+    int sync_sockets(int keep = (1 << SOCKET_COUNT) - 1);
+
     /**
     * Closes a socket
     *
@@ -265,6 +602,51 @@ public:
     */
     void set_timeout(uint32_t timeout_ms=ESP8266_MISC_TIMEOUT);
 
+    /**
+    * Wait for sockets to become readable, writable or closed
+    *
+    * Readiness is kept up to date by OOB processing, see bg_process_oob, so
+    * waiting takes one wakeup and one read of the readiness bitmap.
+    *
+    * @param interest bitwise or of poll_mask() for the sockets and events to wait for
+    * @param timeout time to wait in milliseconds, 0 to return immediately
+    * @return the ready subset of interest, 0 on timeout
+    */
+    uint32_t poll(uint32_t interest, uint32_t timeout);
+
+    /**
+    * Readiness bits of a socket, as used by poll
+    *
+    * @param id id of socket, valid 0-4
+    * @param events bitwise or of POLLIN, POLLOUT and POLLHUP
+    * @return bits for the events of the socket
+    */
+    static uint32_t poll_mask(int id, uint32_t events) {
+        return events << (id * 4);
+    }
+
+    /**
+    * Events of a socket in readiness bits returned by poll
+    *
+    * @param id id of socket, valid 0-4
+    * @param ready readiness bits
+    * @return bitwise or of POLLIN, POLLOUT and POLLHUP
+    */
+    static uint32_t poll_events(int id, uint32_t ready) {
+        return (ready >> (id * 4)) & (POLLIN | POLLOUT | POLLHUP);
+    }
+
+    /**
+    * Process pending OOB messages, like received data, in the calling thread
+    *
+    * Meant to be called from an event queue when serial port signals sigio, so
+    * that blocked receives are woken up without anyone polling the modem.
+    *
+    * @param timeout AT parser timeout
+    * @param all process all pending messages instead of only one
+    */
+    void bg_process_oob(uint32_t timeout, bool all);
+
     /**
     * Checks if data is available
     */
@@ -293,6 +675,24 @@ public:
         sigio(Callback<void()>(obj, method));
     }
 
+    /**
+    * Attach a function to call whenever data for a socket has been received
+    *
+    * @param func A pointer to a void function taking the socket id, or 0 to set as none
+    */
+    void socket_sigio(Callback<void(int)> func);
+
+    /**
+    * Attach a function to call whenever data for a socket has been received
+    *
+    * @param obj pointer to the object to call the member function on
+    * @param method pointer to the member function to call
+    */
+    template <typename T, typename M>
+    void socket_sigio(T *obj, M method) {
+        socket_sigio(Callback<void(int)>(obj, method));
+    }
+
     /**
     * Attach a function to call whenever network state has changed.
     *
@@ -323,6 +723,37 @@ public:
      */
     nsapi_connection_status_t connection_status() const;
 
+    /**
+     * Check whether modem has been reset by its watchdog since last call
+     *
+     * Sockets open at the time of reset report NSAPI_ERROR_CONNECTION_LOST. Modem
+     * has lost its configuration, it is expected to be set up again.
+     *
+     * @return true if a watchdog reset has been detected
+     */
+    bool watchdog_reset_detected();
+
+    /**
+     * Get the access point joined, with AT+CWJAP_CUR?
+     *
+     * Needs an AT firmware that reports RSSI with the query.
+     *
+     * @param ssid placeholder for the network's name, 33 bytes
+     * @param bssid placeholder for access point's BSSID, 6 bytes
+     * @param rssi placeholder for the signal strength
+     * @return true if joined to an access point
+     */
+    bool ap_info(char *ssid, uint8_t *bssid, int8_t *rssi);
+
+    /**
+     * Close all links, before leaving the access point for example
+     *
+     * Sockets open at the time report NSAPI_ERROR_CONNECTION_LOST, as with a watchdog reset.
+     *
+     * @return true if modem closed the links
+     */
+    bool drop_links();
+
     /**
      * Start board's and ESP8266's UART flow control
      *
@@ -339,14 +770,55 @@ public:
 
     /*
      * From AT firmware v1.7.0.0 onwards enables TCP passive mode
+     *
+     * With "esp8266.tcp-adaptive-recv-mode" the driver starts in active mode and switches to
+     * passive mode only while socket data buffer usage is high
      */
     bool cond_enable_tcp_passive_mode();
 
+    /**
+    * TCP receive mode transitions made by the adaptive policy
+    *
+    * @param to_passive Switches to passive mode due to high socket data buffer usage
+    * @param to_active Switches back to active mode
+    */
+    struct recv_mode_stats {
+        uint32_t to_passive;
+        uint32_t to_active;
+    };
+
+    /**
+    * Get TCP receive mode transition counters
+    *
+    * @return recv_mode_stats, all zero unless adaptive receive mode is in use
+    */
+    struct recv_mode_stats tcp_recv_mode_stats();
+
     static const int8_t WIFIMODE_STATION = 1;
     static const int8_t WIFIMODE_SOFTAP = 2;
     static const int8_t WIFIMODE_STATION_SOFTAP = 3;
     static const int8_t SOCKET_COUNT = 5;
 
+    // Socket readiness events
+    static const uint32_t POLLIN = 0x1; // Data buffered or waiting on modem
+    static const uint32_t POLLOUT = 0x2; // Open, accepts data to send
+    static const uint32_t POLLHUP = 0x4; // Closed by modem or remote end
+
+    // Scan result fields, see set_scan_options
+    static const int SCAN_ECN_BIT = 0;
+    static const int SCAN_SSID_BIT = 1;
+    static const int SCAN_RSSI_BIT = 2;
+    static const int SCAN_MAC_BIT = 3;
+    static const int SCAN_CHANNEL_BIT = 4;
+    static const uint16_t SCAN_ECN = 1 << SCAN_ECN_BIT;
+    static const uint16_t SCAN_SSID = 1 << SCAN_SSID_BIT;
+    static const uint16_t SCAN_RSSI = 1 << SCAN_RSSI_BIT;
+    static const uint16_t SCAN_MAC = 1 << SCAN_MAC_BIT;
+    static const uint16_t SCAN_CHANNEL = 1 << SCAN_CHANNEL_BIT;
+    static const uint16_t SCAN_FREQ_OFFSET = 0x20;
+    static const uint16_t SCAN_FREQ_CAL = 0x40;
+    static const uint16_t SCAN_DEFAULT = 0x7f;
+
 private:
     // FW version
     struct fw_sdk_version _sdk_v;
@@ -354,7 +826,16 @@ private:
 
     // FW version specific settings and functionalities
     bool _tcp_passive;
-    int32_t _recv_tcp_passive(int id, void *data, uint32_t amount, uint32_t timeout);
+    bool _tcp_adaptive;
+    bool _tcp_mode_check; // Heap high watermark reached while parsing, see _process_oob
+    struct recv_mode_stats _tcp_recv_mode_stats;
+    bool _set_tcp_recv_mode(bool passive);
+    void _adapt_tcp_recv_mode();
+    int32_t _recv_tcp_passive(int id, void *data, uint32_t amount);
+    int32_t _prefetch_tcp_passive(int id, uint32_t amount);
+    uint32_t _rx_room(int id);
+    void _schedule_tcp_passive();
+    int _tcp_sched_next;
 
     // UART settings
     UARTSerial _serial;
@@ -367,20 +848,81 @@ private:
 
     // Wifi scan result handling
     bool _recv_ap(nsapi_wifi_ap_t *ap);
+    bool _scan_active; // AT+CWLAP sent, final OK not received yet
+    uint64_t _scan_start;
+    unsigned _scan_count;
+    nsapi_error_t _scan_status;
+    Callback<void(const WiFiAccessPoint *, int)> _scan_cb;
+    WiFiAccessPoint *_scan_res; // Array filled by blocking scan
+    unsigned _scan_limit;
+    int8_t _scan_rssi; // Of the latest result
+    uint16_t _scan_mask; // Fields in +CWLAP lines
+    bool _scan_sort;
+    bool _scan_opts_set; // AT+CWLAPOPT applied since modem's reset
+    bool _scan_filtered; // Scan for an SSID or a channel only
+
+    // Access points seen by scans, with AT+CWLAPOPT's MAC field only
+    struct {
+        nsapi_wifi_ap_t ap;
+        uint64_t seen_ms;
+    } _scan_cache[ESP8266_SCAN_CACHE_SIZE];
+    unsigned _scan_cache_len;
+    uint64_t _scan_cache_ms; // Start of last full scan
+    bool _scan_cache_valid;
+    void _scan_cache_add(const nsapi_wifi_ap_t *ap);
+    bool _scan_opts_apply();
+    void _scan_poll(uint32_t timeout);
+    void _scan_wait();
+    void _scan_end(nsapi_error_t status);
+    void _scan_fill(const WiFiAccessPoint *ap, int status);
+
+    // Join started by connect_async, holds off commands as a scan does
+    bool _join_active; // AT+CWJAP_CUR sent, final OK or FAIL not received yet
+    uint64_t _join_start;
+    Callback<void(nsapi_error_t)> _join_cb;
+    bool _send_join(const char *ap, const char *passPhrase, const uint8_t *bssid);
+    nsapi_error_t _join_error();
+    void _join_poll(uint32_t timeout);
+    void _join_end(nsapi_error_t status);
 
     // Socket data buffer
     struct packet {
         struct packet *next;
         int id;
+        uint8_t gen; // Connection on link id the data belongs to
+        char remote_ip[16]; // Sender, with AT+CIPDINFO=1 only
+        uint16_t remote_port;
         uint32_t len; // Remaining length
         uint32_t alloc_len; // Original length
         // data follows
     } *_packets, **_packets_end;
     void _clear_socket_packets(int id);
+    int32_t _recv_tcp_packet(int id, void *data, uint32_t amount);
+    int32_t _recv_tcp(int id, void *data, uint32_t amount);
+    int32_t _recv_udp(int id, void *data, uint32_t amount);
+    int32_t _recv_udp_from(int id, const char *addr, int port, void *data, uint32_t amount);
+    struct packet **_packet_find(int id, const char *addr, int port);
+    bool _send(int id, const void *data, uint32_t amount, const char *addr, int port);
+    uint32_t _packet_take(struct packet **p, void *data, uint32_t amount);
+    bool _recv_ipd_len(bool passive, int *amount, char *ip, int *port);
+
+    // Blocking receive
+    int32_t _recv_wait(int id, void *data, uint32_t amount, uint32_t timeout,
+                       int32_t (ESP8266::*recv)(int, void *, uint32_t));
+    EventFlags _sock_evt_flags; // Bit per socket, set on data or close
+    struct wakeup_stats _recv_wakeup_stats;
+    void _sock_event(int id);
+    void _wakeup_stats_update(int id, bool placed);
+    void _discard(int amount);
 
     // Memory statistics
     size_t _heap_usage; // (Socket data buffer usage)
 
+    // Socket readiness, poll_mask() bits per socket
+    uint32_t _sock_ready;
+    ConditionVariable _sock_ready_cond;
+    void _update_ready(int id);
+
     // OOB processing
     void _process_oob(uint32_t timeout, bool all);
 
@@ -397,6 +939,7 @@ private:
     void _oob_connection_status();
     void _oob_socket_close_err();
     void _oob_watchdog_reset();
+    void _oob_scan_result();
 
     // OOB state variables
     int _connect_error;
@@ -404,6 +947,10 @@ private:
     bool _sock_already;
     bool _closed;
     bool _error;
+    bool _wdt_reset;
+    bool _dinfo; // +IPD carries sender, AT+CIPDINFO=1
+    int _ssl_bufsize;
+    bool _ssl_bufsize_set; // AT+CIPSSLSIZE given
 
     // Modem's address info
     char _ip_buffer[16];
@@ -415,8 +962,25 @@ private:
     struct _sock_info {
         bool open;
         nsapi_protocol_t proto;
+        uint32_t tcp_data_avbl; // Data waiting on modem, passive mode only
+        uint32_t tcp_deficit; // Passive mode fetch allowance
+        uint8_t tcp_weight; // Passive mode share of fetches
+        uint32_t rcvbuf; // Reserved share of socket data buffer, 0 if none
+        uint32_t rx_buffered; // Data in socket data buffer
+        uint32_t rx_packets; // Packets in socket data buffer
+        uint32_t event_us; // Last time data or close was signaled
+        bool hup; // Closed by modem
+        bool lost; // Closed by modem's watchdog reset
+        void *rx_wait_buf; // Buffer of a reader sleeping in recv, active mode data is placed here
+        uint32_t rx_wait_len;
+        int32_t rx_placed; // Amount placed to rx_wait_buf, -1 if none
+        uint32_t rx_full_len; // Length of last datagram received, before truncation
+        uint8_t gen; // Bumped for every connection on the link
+        bool opening; // AT+CIPSTART in progress
+        bool any_remote; // UDP mode 2, datagrams kept apart by sender
     };
     struct _sock_info _sock_i[SOCKET_COUNT];
+    Callback<void(int)> _sock_sigio_cb; // ESP8266Interface registered
 
     // Connection state reporting
     nsapi_connection_status_t _conn_status;
@@ -49,20 +49,59 @@ ESP8266Interface::ESP8266Interface()
       _initialized(false),
       _started(false),
       _conn_stat(NSAPI_STATUS_DISCONNECTED),
-      _conn_stat_cb(NULL)
+      _conn_stat_cb(NULL),
+      _oob_event_id(0),
+      _queue(ESP8266_EVENT_QUEUE_SIZE * EVENTS_EVENT_SIZE),
+      _thread(osPriorityNormal, ESP8266_THREAD_STACK_SIZE, NULL, "esp8266"),
+      _auto_reconnect(false),
+      _reconnect_event_id(0),
+      _reconnect_down_ms(0),
+      _reconnect_backoff(ESP8266_RECONNECT_BACKOFF_MIN),
+      _reconnect_setup(false)
 {
     memset(_cbs, 0, sizeof(_cbs));
     memset(ap_ssid, 0, sizeof(ap_ssid));
     memset(ap_pass, 0, sizeof(ap_pass));
-
+    memset(_creds, 0, sizeof(_creds));
+    _creds_len = 0;
+    memset(_ap_hist, 0, sizeof(_ap_hist));
+    _ap_hist_next = 0;
+    memset(&_reconnect_stats, 0, sizeof(_reconnect_stats));
+    _roam_enabled = false;
+    _roam_threshold = ESP8266_ROAM_RSSI_THRESHOLD;
+    _roam_event_id = 0;
+    _roam_active = false;
+    _roam_switching = false;
+    _roam_found = false;
+    _roam_start = 0;
+    memset(&_roam_stats, 0, sizeof(_roam_stats));
+
+    _thread.start(callback(&_queue, &events::EventQueue::dispatch_forever));
     _esp.sigio(this, &ESP8266Interface::event);
+    _esp.socket_sigio(this, &ESP8266Interface::socket_event);
     _esp.set_timeout();
     _esp.attach(this, &ESP8266Interface::update_conn_state_cb);
 
     for(int i= 0; i < ESP8266_SOCKET_COUNT; i++) {
         _sock_i[i].open = false;
-        _sock_i[i].sport = -1;
+        _sock_i[i].socket = 0;
+        _sock_i[i].released = 0;
+        _sock_i[i].parked = false;
+        _sock_i[i].parked_ms = 0;
+        _sock_i[i].ssl = false;
+    }
+    _sock_released = 0;
+    _socks = 0;
+    _evictions = 0;
+    _shared_id = -1;
+    _tx_event_id = 0;
+    _rand_state = 0;
+    memset(&_pool_stats, 0, sizeof(_pool_stats));
+    for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+        _shared_cbs[i].callback = 0;
+        _shared_cbs[i].data = 0;
     }
+    memset(_shared_used, 0, sizeof(_shared_used));
 }
 #endif
 
@@ -73,20 +112,59 @@ ESP8266Interface::ESP8266Interface(PinName tx, PinName rx, bool debug, PinName r
       _initialized(false),
       _started(false),
       _conn_stat(NSAPI_STATUS_DISCONNECTED),
-      _conn_stat_cb(NULL)
+      _conn_stat_cb(NULL),
+      _oob_event_id(0),
+      _queue(ESP8266_EVENT_QUEUE_SIZE * EVENTS_EVENT_SIZE),
+      _thread(osPriorityNormal, ESP8266_THREAD_STACK_SIZE, NULL, "esp8266"),
+      _auto_reconnect(false),
+      _reconnect_event_id(0),
+      _reconnect_down_ms(0),
+      _reconnect_backoff(ESP8266_RECONNECT_BACKOFF_MIN),
+      _reconnect_setup(false)
 {
     memset(_cbs, 0, sizeof(_cbs));
     memset(ap_ssid, 0, sizeof(ap_ssid));
     memset(ap_pass, 0, sizeof(ap_pass));
-
+    memset(_creds, 0, sizeof(_creds));
+    _creds_len = 0;
+    memset(_ap_hist, 0, sizeof(_ap_hist));
+    _ap_hist_next = 0;
+    memset(&_reconnect_stats, 0, sizeof(_reconnect_stats));
+    _roam_enabled = false;
+    _roam_threshold = ESP8266_ROAM_RSSI_THRESHOLD;
+    _roam_event_id = 0;
+    _roam_active = false;
+    _roam_switching = false;
+    _roam_found = false;
+    _roam_start = 0;
+    memset(&_roam_stats, 0, sizeof(_roam_stats));
+
+    _thread.start(callback(&_queue, &events::EventQueue::dispatch_forever));
     _esp.sigio(this, &ESP8266Interface::event);
+    _esp.socket_sigio(this, &ESP8266Interface::socket_event);
     _esp.set_timeout();
     _esp.attach(this, &ESP8266Interface::update_conn_state_cb);
 
     for(int i= 0; i < ESP8266_SOCKET_COUNT; i++) {
         _sock_i[i].open = false;
-        _sock_i[i].sport = -1;
+        _sock_i[i].socket = 0;
+        _sock_i[i].released = 0;
+        _sock_i[i].parked = false;
+        _sock_i[i].parked_ms = 0;
+        _sock_i[i].ssl = false;
+    }
+    _sock_released = 0;
+    _socks = 0;
+    _evictions = 0;
+    _shared_id = -1;
+    _tx_event_id = 0;
+    _rand_state = 0;
+    memset(&_pool_stats, 0, sizeof(_pool_stats));
+    for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+        _shared_cbs[i].callback = 0;
+        _shared_cbs[i].data = 0;
     }
+    memset(_shared_used, 0, sizeof(_shared_used));
 }
 
 int ESP8266Interface::connect(const char *ssid, const char *pass, nsapi_security_t security,
@@ -96,23 +174,37 @@ int ESP8266Interface::connect(const char *ssid, const char *pass, nsapi_security
         return NSAPI_ERROR_UNSUPPORTED;
     }
 
+    _conn_mutex.lock();
     int err = set_credentials(ssid, pass, security);
     if(err) {
+        _conn_mutex.unlock();
         return err;
     }
 
-    return connect();
+    err = connect();
+    _conn_mutex.unlock();
+    return err;
 }
 
 int ESP8266Interface::connect()
+{
+    // Held throughout so roaming stays out of the way, see _roam()
+    _conn_mutex.lock();
+    nsapi_error_t status = _connect();
+    _conn_mutex.unlock();
+
+    return status;
+}
+
+nsapi_error_t ESP8266Interface::_connect()
 {
     nsapi_error_t status;
 
-    if (strlen(ap_ssid) == 0) {
+    if (strlen(ap_ssid) == 0 && !_creds_len) {
         return NSAPI_ERROR_NO_SSID;
     }
 
-    if (_ap_sec != NSAPI_SECURITY_NONE) {
+    if (_ap_sec != NSAPI_SECURITY_NONE && !_creds_len) {
         if (strlen(ap_pass) < ESP8266_PASSPHRASE_MIN_LENGTH) {
             return NSAPI_ERROR_PARAMETER;
         }
@@ -137,7 +229,7 @@ int ESP8266Interface::connect()
         return NSAPI_ERROR_DHCP_FAILURE;
     }
 
-    int connect_error = _esp.connect(ap_ssid, ap_pass);
+    int connect_error = _creds_len ? _connect_best() : _esp.connect(ap_ssid, ap_pass);
     if (connect_error) {
         return connect_error;
     }
@@ -188,6 +280,157 @@ int ESP8266Interface::set_credentials(const char *ssid, const char *pass, nsapi_
     return NSAPI_ERROR_OK;
 }
 
+nsapi_error_t ESP8266Interface::add_credentials(const char *ssid, const char *pass, nsapi_security_t security)
+{
+    if (_creds_len == ESP8266_CREDENTIALS_MAX) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    if (!ssid || strlen(ssid) == 0 || strlen(ssid) > ESP8266_SSID_MAX_LENGTH) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    if (security != NSAPI_SECURITY_NONE && (!pass || strlen(pass) < ESP8266_PASSPHRASE_MIN_LENGTH
+                                            || strlen(pass) > ESP8266_PASSPHRASE_MAX_LENGTH)) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    struct ap_credential *cred = &_creds[_creds_len++];
+    memset(cred, 0, sizeof(*cred));
+    strncpy(cred->ssid, ssid, sizeof(cred->ssid));
+    if (security != NSAPI_SECURITY_NONE) {
+        strncpy(cred->pass, pass, sizeof(cred->pass));
+    }
+    cred->sec = security;
+
+    return NSAPI_ERROR_OK;
+}
+
+void ESP8266Interface::clear_credentials()
+{
+    memset(_creds, 0, sizeof(_creds));
+    _creds_len = 0;
+}
+
+int ESP8266Interface::_ap_candidates(struct ap_candidate *cands, unsigned max)
+{
+    WiFiAccessPoint *aps = new WiFiAccessPoint[ESP8266_SCAN_CACHE_SIZE];
+    if (!aps) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    int cnt = _esp.scan_cached(aps, ESP8266_SCAN_CACHE_SIZE, ESP8266_AP_SELECT_MAX_AGE);
+
+    unsigned n = 0;
+    for (int i = 0; i < cnt; i++) {
+        static const uint8_t no_bssid[6] = {0};
+        if (memcmp(aps[i].get_bssid(), no_bssid, sizeof(no_bssid)) == 0) {
+            continue; // Not pinnable, AT+CWLAPOPT leaves BSSID out
+        }
+
+        for (unsigned c = 0; c < _creds_len; c++) {
+            if (strcmp(aps[i].get_ssid(), _creds[c].ssid) != 0) {
+                continue;
+            }
+
+            // Kept sorted, best first
+            int score = aps[i].get_rssi() + ESP8266_AP_HISTORY_WEIGHT * _ap_history(aps[i].get_bssid());
+            unsigned j = n < max ? n++ : max;
+            for (; j > 0 && cands[j - 1].score < score; j--) {
+                if (j < max) {
+                    cands[j] = cands[j - 1];
+                }
+            }
+            if (j < max) {
+                cands[j].cred = c;
+                memcpy(cands[j].bssid, aps[i].get_bssid(), sizeof(cands[j].bssid));
+                cands[j].score = score;
+            }
+            break;
+        }
+    }
+
+    delete[] aps;
+    return cnt < 0 ? cnt : n;
+}
+
+nsapi_error_t ESP8266Interface::_connect_best()
+{
+    struct ap_candidate cands[ESP8266_SCAN_CACHE_SIZE];
+    bool seen[ESP8266_CREDENTIALS_MAX] = {false};
+    nsapi_error_t err = NSAPI_ERROR_NO_SSID;
+
+    int n = _ap_candidates(cands, ESP8266_SCAN_CACHE_SIZE);
+    for (int i = 0; i < n; i++) {
+        seen[cands[i].cred] = true;
+        err = _connect_cred(cands[i].cred, cands[i].bssid);
+        if (err == NSAPI_ERROR_OK) {
+            return err;
+        }
+    }
+
+    // Hidden or missed by the scan, modem looks for them itself
+    for (unsigned c = 0; c < _creds_len; c++) {
+        if (!seen[c]) {
+            err = _connect_cred(c, 0);
+            if (err == NSAPI_ERROR_OK) {
+                return err;
+            }
+        }
+    }
+
+    return err;
+}
+
+nsapi_error_t ESP8266Interface::_connect_cred(unsigned cred, const uint8_t *bssid)
+{
+    nsapi_error_t err = _esp.connect(_creds[cred].ssid, _creds[cred].pass, bssid);
+    if (bssid) {
+        _ap_history_update(bssid, err == NSAPI_ERROR_OK);
+    }
+
+    // Rejoins are made with the network joined last
+    if (err == NSAPI_ERROR_OK) {
+        strncpy(ap_ssid, _creds[cred].ssid, sizeof(ap_ssid));
+        strncpy(ap_pass, _creds[cred].pass, sizeof(ap_pass));
+        _ap_sec = _creds[cred].sec;
+    }
+
+    return err;
+}
+
+int ESP8266Interface::_ap_history(const uint8_t *bssid)
+{
+    for (int i = 0; i < ESP8266_AP_HISTORY_SIZE; i++) {
+        if (memcmp(_ap_hist[i].bssid, bssid, sizeof(_ap_hist[i].bssid)) == 0) {
+            return _ap_hist[i].history;
+        }
+    }
+
+    return 0;
+}
+
+void ESP8266Interface::_ap_history_update(const uint8_t *bssid, bool joined)
+{
+    int i = 0;
+    for (; i < ESP8266_AP_HISTORY_SIZE; i++) {
+        if (memcmp(_ap_hist[i].bssid, bssid, sizeof(_ap_hist[i].bssid)) == 0) {
+            break;
+        }
+    }
+
+    // New access point takes the oldest entry
+    if (i == ESP8266_AP_HISTORY_SIZE) {
+        i = _ap_hist_next;
+        _ap_hist_next = (_ap_hist_next + 1) % ESP8266_AP_HISTORY_SIZE;
+        memcpy(_ap_hist[i].bssid, bssid, sizeof(_ap_hist[i].bssid));
+        _ap_hist[i].history = 0;
+    }
+
+    int history = _ap_hist[i].history + (joined ? 1 : -2);
+    _ap_hist[i].history = history > 4 ? 4 : history < -4 ? -4 : history;
+}
+
 int ESP8266Interface::set_channel(uint8_t channel)
 {
     return NSAPI_ERROR_UNSUPPORTED;
@@ -196,10 +439,16 @@ int ESP8266Interface::set_channel(uint8_t channel)
 
 int ESP8266Interface::disconnect()
 {
+    _conn_mutex.lock();
     _started = false;
     _initialized = false;
+    _reconnect_cancel();
+    _shared_lost();
 
-    return _esp.disconnect() ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
+    bool done = _esp.disconnect();
+    _conn_mutex.unlock();
+
+    return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
 }
 
 const char *ESP8266Interface::get_ip_address()
@@ -237,6 +486,47 @@ int8_t ESP8266Interface::get_rssi()
 }
 
 int ESP8266Interface::scan(WiFiAccessPoint *res, unsigned count)
+{
+    return scan(res, count, 0);
+}
+
+int ESP8266Interface::scan(WiFiAccessPoint *res, unsigned count, const char *ssid, uint8_t channel)
+{
+    nsapi_error_t status;
+
+    status = _init();
+    if(status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    status = _startup(ESP8266::WIFIMODE_STATION);
+    if(status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    return _esp.scan(res, count, ssid, channel);
+}
+
+int ESP8266Interface::scan_cached(WiFiAccessPoint *res, unsigned count, uint32_t max_age_ms, const char *ssid,
+                                  uint8_t channel)
+{
+    nsapi_error_t status;
+
+    status = _init();
+    if(status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    status = _startup(ESP8266::WIFIMODE_STATION);
+    if(status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    return _esp.scan_cached(res, count, max_age_ms, ssid, channel);
+}
+
+nsapi_error_t ESP8266Interface::scan_async(mbed::Callback<void(const WiFiAccessPoint *, int)> cb,
+                                           const char *ssid, uint8_t channel)
 {
     nsapi_error_t status;
 
@@ -250,7 +540,17 @@ int ESP8266Interface::scan(WiFiAccessPoint *res, unsigned count)
         return status;
     }
 
-    return _esp.scan(res, count);
+    return _esp.scan_async(cb, ssid, channel);
+}
+
+nsapi_error_t ESP8266Interface::set_scan_options(bool sort, uint16_t mask)
+{
+    nsapi_error_t status = _init();
+    if (status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    return _esp.set_scan_options(sort, mask) ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
 }
 
 bool ESP8266Interface::_get_firmware_ok()
@@ -283,6 +583,8 @@ nsapi_error_t ESP8266Interface::_init(void)
         if (!_esp.reset()) {
             return NSAPI_ERROR_DEVICE_ERROR;
         }
+        _shared_lost();
+        _random_seed();
         if (!_esp.start_uart_hw_flow_ctrl()) {
             return NSAPI_ERROR_DEVICE_ERROR;
         }
@@ -311,168 +613,926 @@ nsapi_error_t ESP8266Interface::_startup(const int8_t wifi_mode)
     return NSAPI_ERROR_OK;
 }
 
+nsapi_error_t ESP8266Interface::set_ssl_buffer_size(int size)
+{
+    return _esp.set_ssl_buffer_size(size) ? NSAPI_ERROR_OK : NSAPI_ERROR_PARAMETER;
+}
+
+ESP8266Interface::tcp_pool_stats ESP8266Interface::get_tcp_pool_stats() const
+{
+    return _pool_stats;
+}
+
+uint32_t ESP8266Interface::get_socket_evictions() const
+{
+    return _evictions;
+}
+
 struct esp8266_socket {
-    int id;
+    int id; // Link, -1 if UDP socket's link has been handed over to another socket
     nsapi_protocol_t proto;
     bool connected;
     SocketAddress addr;
     int keepalive; // TCP
+    int weight; // TCP
+    int recv_timeout;
+    uint16_t sport; // UDP, 0 if not bound
+    uint32_t idle_timeout; // UDP, 0 if link is never handed over
+    uint64_t last_used;
+    int busy; // Calls using the link, which is then kept from eviction
+    void (*callback)(void *);
+    void *data;
+    struct esp8266_socket *next;
+    bool shared; // UDP, uses the shared link, see _shared_id
+    int slot; // Index to _shared_cbs
+    bool pooled; // TCP, connection is parked on close for reuse
+    bool ssl; // TCP, secured by modem's SSL
+    uint32_t rcvbuf; // Reserved share of driver's receive buffer, 0 if none
+    uint32_t sndbuf; // Max data per AT+CIPSEND
+    uint32_t sndlowat; // TCP, data is held back until this much is buffered, 0 sends at once
+    uint8_t *tx_buf; // TCP, sndbuf bytes if sndlowat is set
+    uint32_t tx_len;
+    nsapi_error_t tx_err; // Failure of a delayed flush, reported by the next call
+    uint32_t rx_truncated; // UDP, datagrams cut short to the receive buffer
 };
 
-int ESP8266Interface::socket_open(void **handle, nsapi_protocol_t proto)
+nsapi_error_t ESP8266Interface::sync_sockets()
+{
+    int keep = 0;
+
+    _link_mutex.lock();
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (_sock_i[i].open) {
+            keep |= 1 << i;
+        }
+    }
+
+    int live = _esp.sync_sockets(keep);
+    if (live < 0) {
+        _link_mutex.unlock();
+        return live;
+    }
+
+    // Links modem no longer has
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (!_sock_i[i].open || (live & (1 << i))) {
+            continue;
+        }
+        if (_sock_i[i].socket) {
+            _sock_i[i].socket->connected = false; // UDP reopens on next send
+        } else if (_sock_i[i].parked) {
+            _sock_i[i].parked = false;
+            _link_release(i);
+        } else if (i == _shared_id) {
+            _link_release(i);
+            _shared_id = -1;
+        }
+    }
+    _link_mutex.unlock();
+
+    return NSAPI_ERROR_OK;
+}
+
+int ESP8266Interface::_link_alloc()
 {
-    // Look for an unused socket
+    // Look for the unused link released longest ago, late data of a link's previous
+    // connection has then had most time to drain
     int id = -1;
 
     for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
-        if (!_sock_i[i].open) {
+        if (!_sock_i[i].open && (id == -1 || _sock_i[i].released < _sock_i[id].released)) {
             id = i;
-            _sock_i[i].open = true;
-            break;
         }
     }
 
+    // Parked connections go first, they are only a shortcut
     if (id == -1) {
-        return NSAPI_ERROR_NO_SOCKET;
+        id = _pool_drop();
     }
+    if (id == -1) {
+        id = _link_evict();
+    }
+    if (id != -1) {
+        _sock_i[id].open = true;
+    }
+    return id;
+}
 
-    struct esp8266_socket *socket = new struct esp8266_socket;
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+int ESP8266Interface::_pool_drop()
+{
+    int id = -1;
+
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (_sock_i[i].parked && (id == -1 || _sock_i[i].parked_ms < _sock_i[id].parked_ms)) {
+            id = i;
+        }
     }
 
-    socket->id = id;
-    socket->proto = proto;
-    socket->connected = false;
-    socket->keepalive = 0;
-    *handle = socket;
-    return 0;
+    if (id != -1) {
+        _esp.close(id);
+        _sock_i[id].parked = false;
+        _link_release(id);
+    }
+    return id;
 }
 
-int ESP8266Interface::socket_close(void *handle)
+bool ESP8266Interface::_pool_park(struct esp8266_socket *socket)
 {
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
-    int err = 0;
+    int parked = 0;
 
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+    if (!socket->pooled || !socket->connected || !_esp.tcp_reusable(socket->id)) {
+        return false;
     }
 
-    if (socket->connected && !_esp.close(socket->id)) {
-        err = NSAPI_ERROR_DEVICE_ERROR;
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (_sock_i[i].parked) {
+            parked++;
+        }
+    }
+    if (parked >= MBED_CONF_ESP8266_TCP_POOL_SIZE) {
+        _pool_drop();
     }
 
+    // Link stays open with nobody owning it
+    int id = socket->id;
+    _sock_i[id].socket = 0;
+    _sock_i[id].parked = true;
+    _sock_i[id].parked_ms = rtos::Kernel::get_ms_count();
+    _sock_i[id].addr = socket->addr;
+    _sock_i[id].ssl = socket->ssl;
+    _cbs[id].callback = 0;
+    _cbs[id].data = 0;
+    _esp.set_rcvbuf(id, 0);
+    socket->id = -1;
     socket->connected = false;
-    _sock_i[socket->id].open = false;
-    _sock_i[socket->id].sport = -1;
-    delete socket;
-    return err;
+    return true;
 }
 
-int ESP8266Interface::socket_bind(void *handle, const SocketAddress &address)
+bool ESP8266Interface::_pool_take(struct esp8266_socket *socket, const SocketAddress &addr)
 {
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
-
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
-    }
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        if (!_sock_i[i].parked || _sock_i[i].addr != addr || _sock_i[i].ssl != socket->ssl) {
+            continue;
+        }
 
-    if (socket->proto == NSAPI_UDP) {
-        if(address.get_addr().version != NSAPI_UNSPEC) {
-            return NSAPI_ERROR_UNSUPPORTED;
+        _sock_i[i].parked = false;
+        if (!_esp.tcp_reusable(i)) {
+            // Closed by server while parked, or data nobody asked for arrived
+            _esp.close(i);
+            _link_release(i);
+            continue;
         }
 
-        for(int id = 0; id < ESP8266_SOCKET_COUNT; id++) {
-            if(_sock_i[id].sport == address.get_port() && id != socket->id) { // Port already reserved by another socket
-                return NSAPI_ERROR_PARAMETER;
-            } else if (id == socket->id && socket->connected) {
-                return NSAPI_ERROR_PARAMETER;
-            }
+        // Swap the socket's own, unconnected link for the parked one
+        if (socket->id != -1) {
+            _link_release(socket->id);
         }
-        _sock_i[socket->id].sport = address.get_port();
-        return 0;
+        socket->id = i;
+        _sock_i[i].socket = socket;
+        _cbs[i].callback = socket->callback;
+        _cbs[i].data = socket->data;
+        _esp.set_tcp_weight(i, socket->weight);
+        _esp.set_rcvbuf(i, socket->rcvbuf);
+        return true;
     }
 
-    return NSAPI_ERROR_UNSUPPORTED;
+    return false;
 }
 
-int ESP8266Interface::socket_listen(void *handle, int backlog)
+void ESP8266Interface::_link_release(int id)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    _sock_i[id].open = false;
+    _sock_i[id].socket = 0;
+    _sock_i[id].released = ++_sock_released;
+    _cbs[id].callback = 0;
+    _cbs[id].data = 0;
+    _esp.set_rcvbuf(id, 0);
 }
 
-int ESP8266Interface::socket_connect(void *handle, const SocketAddress &addr)
+int ESP8266Interface::_link_evict()
 {
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
-    nsapi_error_t ret;
+    struct esp8266_socket *lru = 0;
+    uint64_t now = rtos::Kernel::get_ms_count();
 
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+    // Least recently used UDP link idle past its socket's timeout, with nothing left to read
+    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
+        struct esp8266_socket *socket = _sock_i[i].socket;
+        if (!socket || socket->proto != NSAPI_UDP || !socket->idle_timeout || socket->busy) {
+            continue;
+        }
+        if (now - socket->last_used < socket->idle_timeout || _esp.rx_buffered(i)) {
+            continue;
+        }
+        if (!lru || socket->last_used < lru->last_used) {
+            lru = socket;
+        }
     }
 
-    if (socket->proto == NSAPI_UDP) {
-        ret = _esp.open_udp(socket->id, addr.get_ip_address(), addr.get_port(), _sock_i[socket->id].sport);
-    } else {
-        ret = _esp.open_tcp(socket->id, addr.get_ip_address(), addr.get_port(), socket->keepalive);
+    if (!lru) {
+        return -1;
     }
 
-    socket->connected = (ret == NSAPI_ERROR_OK) ? true : false;
-
-    return ret;
+    int id = lru->id;
+    if (lru->connected && !_esp.close(id)) {
+        return -1;
+    }
+    lru->connected = false; // Reopened on next send
+    lru->id = -1;
+    _link_release(id);
+    _evictions++;
+    return id;
 }
 
-int ESP8266Interface::socket_accept(void *server, void **socket, SocketAddress *addr)
+int ESP8266Interface::_link_pin(struct esp8266_socket *socket)
 {
-    return NSAPI_ERROR_UNSUPPORTED;
+    _link_mutex.lock();
+    int id = socket->id;
+    if (id != -1) {
+        socket->busy++;
+    }
+    _link_mutex.unlock();
+
+    return id;
 }
 
-int ESP8266Interface::socket_send(void *handle, const void *data, unsigned size)
+void ESP8266Interface::_link_unpin(struct esp8266_socket *socket)
 {
-    nsapi_error_t status;
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+    _link_mutex.lock();
+    socket->busy--;
+    _link_mutex.unlock();
+}
 
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+int ESP8266Interface::_link_attach(struct esp8266_socket *socket)
+{
+    _link_mutex.lock();
+    int id = _link_alloc();
+    if (id != -1) {
+        socket->id = id;
+        _sock_i[id].socket = socket;
+        _cbs[id].callback = socket->callback;
+        _cbs[id].data = socket->data;
+        _esp.set_rcvbuf(id, socket->rcvbuf); // Best effort, others may have reserved the buffer meanwhile
     }
+    _link_mutex.unlock();
 
-    status = _esp.send(socket->id, data, size);
-
-    return status != NSAPI_ERROR_OK ? status : size;
+    return id == -1 ? NSAPI_ERROR_NO_SOCKET : NSAPI_ERROR_OK;
 }
 
-int ESP8266Interface::socket_recv(void *handle, void *data, unsigned size)
+void ESP8266Interface::_shared_attach(struct esp8266_socket *socket)
 {
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+    _link_mutex.lock();
+    for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+        if (!_shared_used[i]) {
+            _shared_used[i] = true;
+            _shared_cbs[i].peer = SocketAddress();
+            socket->shared = true;
+            socket->slot = i;
+            socket->idle_timeout = 0; // Holds no link of its own
+            break;
+        }
+    }
+    _link_mutex.unlock();
+}
 
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+void ESP8266Interface::_shared_detach(struct esp8266_socket *socket)
+{
+    _link_mutex.lock();
+    _shared_cbs[socket->slot].callback = 0;
+    _shared_cbs[socket->slot].data = 0;
+    _shared_cbs[socket->slot].peer = SocketAddress();
+    _shared_used[socket->slot] = false;
+    socket->shared = false;
+    socket->slot = -1;
+    socket->connected = false; // Had no link of its own
+
+    // Last one out closes the link
+    bool used = false;
+    for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+        used = used || _shared_used[i];
+    }
+    if (!used && _shared_id != -1) {
+        _esp.close(_shared_id);
+        _link_release(_shared_id);
+        _shared_id = -1;
     }
+    _link_mutex.unlock();
+}
 
-    int32_t recv;
-    if (socket->proto == NSAPI_TCP) {
-        recv = _esp.recv_tcp(socket->id, data, size);
-        if (recv <= 0 && recv != NSAPI_ERROR_WOULD_BLOCK) {
-            socket->connected = false;
+bool ESP8266Interface::_shared_claim(struct esp8266_socket *socket, const SocketAddress &addr)
+{
+    // Replies are told apart by remote end only, two sockets can't share one. Latecomer
+    // moves to a link of its own.
+    _link_mutex.lock();
+    bool taken = false;
+    for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+        if (i != socket->slot && _shared_used[i] && _shared_cbs[i].peer == addr) {
+            taken = true;
+            break;
         }
-    } else {
-        recv = _esp.recv_udp(socket->id, data, size);
     }
+    if (taken) {
+        _shared_detach(socket);
+    }
+    _link_mutex.unlock();
 
-    return recv;
+    return !taken;
 }
 
-int ESP8266Interface::socket_sendto(void *handle, const SocketAddress &addr, const void *data, unsigned size)
+nsapi_error_t ESP8266Interface::_shared_send(const SocketAddress &addr, ESP8266::udp_send *sends, unsigned count,
+                                             int *done)
 {
-    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+    nsapi_error_t status = NSAPI_ERROR_NO_SOCKET;
+
+    *done = 0;
+    _link_mutex.lock();
+    // Second round reopens a link closed by modem
+    for (int i = 0; i < 2; i++) {
+        status = _shared_open(addr);
+        if (status != NSAPI_ERROR_OK) {
+            break;
+        }
 
-    if (!socket) {
-        return NSAPI_ERROR_NO_SOCKET;
+        *done = _esp.send_udp_batch(_shared_id, sends, count);
+        if (*done || i) {
+            break;
+        }
+        _shared_close();
     }
+    _link_mutex.unlock();
 
-    if((strcmp(addr.get_ip_address(), "0.0.0.0") == 0) || !addr.get_port())  {
-        return NSAPI_ERROR_DNS_FAILURE;
+    return status;
+}
+
+nsapi_error_t ESP8266Interface::_shared_open(const SocketAddress &addr)
+{
+    if (_shared_id != -1) {
+        return NSAPI_ERROR_OK;
+    }
+
+    _shared_id = _link_alloc();
+    if (_shared_id == -1) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // Mode 2, remote end is given per datagram
+    int local_port = 49152 + _random() % 16384;
+    nsapi_error_t status = _esp.open_udp(_shared_id, addr.get_ip_address(), addr.get_port(), local_port, 2);
+    if (status != NSAPI_ERROR_OK) {
+        _link_release(_shared_id);
+        _shared_id = -1;
+    }
+
+    return status;
+}
+
+void ESP8266Interface::_shared_close()
+{
+    _esp.close(_shared_id);
+    _link_release(_shared_id);
+    _shared_id = -1;
+}
+
+void ESP8266Interface::_shared_lost()
+{
+    // Modem dropped the link, next sendto opens a new one
+    _link_mutex.lock();
+    if (_shared_id != -1) {
+        _link_release(_shared_id);
+        _shared_id = -1;
+    }
+    _link_mutex.unlock();
+}
+
+int ESP8266Interface::socket_open(void **handle, nsapi_protocol_t proto)
+{
+    struct esp8266_socket *socket = new struct esp8266_socket;
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    socket->id = -1;
+    socket->proto = proto;
+    socket->connected = false;
+    socket->keepalive = 0;
+    socket->weight = 1;
+    socket->recv_timeout = 0;
+    socket->sport = 0;
+    socket->idle_timeout = proto == NSAPI_UDP ? MBED_CONF_ESP8266_SOCKET_IDLE_TIMEOUT : 0;
+    socket->last_used = rtos::Kernel::get_ms_count();
+    socket->callback = 0;
+    socket->data = 0;
+    socket->shared = false;
+    socket->slot = -1;
+    socket->pooled = false;
+    socket->ssl = false;
+    socket->rcvbuf = 0;
+    socket->sndbuf = ESP8266_SNDBUF_MAX;
+    socket->sndlowat = 0;
+    socket->tx_buf = 0;
+    socket->tx_len = 0;
+    socket->tx_err = NSAPI_ERROR_OK;
+    socket->busy = 0;
+    socket->rx_truncated = 0;
+
+    // UDP sockets share one link unless bound, see socket_bind
+    if (proto == NSAPI_UDP && MBED_CONF_ESP8266_UDP_SHARED_LINK) {
+        _shared_attach(socket);
+    }
+
+    // UDP socket that may lose its link when idle may also start without one
+    if (!socket->shared && _link_attach(socket) != NSAPI_ERROR_OK && !socket->idle_timeout) {
+        delete socket;
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if (socket->id != -1) {
+        _esp.set_tcp_weight(socket->id, socket->weight);
+    }
+
+    _link_mutex.lock();
+    socket->next = _socks;
+    _socks = socket;
+    _link_mutex.unlock();
+
+    *handle = socket;
+    return 0;
+}
+
+int ESP8266Interface::socket_close(void *handle)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+    int err = 0;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    _link_mutex.lock();
+    if (socket->tx_len) {
+        _tx_flush(socket);
+    }
+    err = _tx_error(socket);
+    free(socket->tx_buf);
+    if (socket->proto == NSAPI_TCP && _pool_park(socket)) {
+        _pool_stats.parked++;
+    } else if (socket->connected && !_esp.close(socket->id)) {
+        err = NSAPI_ERROR_DEVICE_ERROR;
+    }
+
+    socket->connected = false;
+    if (socket->id != -1) {
+        _link_release(socket->id);
+    }
+    if (socket->shared) {
+        _shared_detach(socket);
+    }
+    for (struct esp8266_socket **p = &_socks; *p; p = &(*p)->next) {
+        if (*p == socket) {
+            *p = socket->next;
+            break;
+        }
+    }
+    _link_mutex.unlock();
+
+    delete socket;
+    return err;
+}
+
+int ESP8266Interface::socket_bind(void *handle, const SocketAddress &address)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if (socket->proto == NSAPI_UDP) {
+        if(address.get_addr().version != NSAPI_UNSPEC) {
+            return NSAPI_ERROR_UNSUPPORTED;
+        }
+
+        if (socket->connected) {
+            return NSAPI_ERROR_PARAMETER;
+        }
+
+        _link_mutex.lock();
+        for (struct esp8266_socket *s = _socks; s; s = s->next) {
+            if (s != socket && s->sport == address.get_port()) { // Port already reserved by another socket
+                _link_mutex.unlock();
+                return NSAPI_ERROR_PARAMETER;
+            }
+        }
+        socket->sport = address.get_port();
+        // Shared link has a local port of its own
+        if (socket->shared && socket->sport) {
+            _shared_detach(socket);
+        }
+        _link_mutex.unlock();
+        return 0;
+    }
+
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+int ESP8266Interface::socket_listen(void *handle, int backlog)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+int ESP8266Interface::socket_connect(void *handle, const SocketAddress &addr)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+    nsapi_error_t ret;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // Stays on the shared link, addr is only the default remote end
+    if (socket->shared && _shared_claim(socket, addr)) {
+        _link_mutex.lock();
+        ret = _shared_open(addr);
+        _link_mutex.unlock();
+        if (ret != NSAPI_ERROR_OK) {
+            return ret;
+        }
+        socket->addr = addr;
+        _shared_cbs[socket->slot].peer = addr;
+        socket->connected = true;
+        socket->last_used = rtos::Kernel::get_ms_count();
+        return NSAPI_ERROR_OK;
+    }
+
+    if (socket->proto == NSAPI_TCP && socket->pooled) {
+        _link_mutex.lock();
+        bool hit = _pool_take(socket, addr);
+        if (hit) {
+            _pool_stats.hits++;
+            _pool_stats.saved_ms += _pool_stats.connect_ms;
+        }
+        _link_mutex.unlock();
+        if (hit) {
+            socket->addr = addr;
+            socket->connected = true;
+            return NSAPI_ERROR_OK;
+        }
+    }
+
+    // Link was handed over to another socket while idle, take one back
+    if (socket->id == -1 && _link_attach(socket) != NSAPI_ERROR_OK) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    uint64_t start = rtos::Kernel::get_ms_count();
+    socket->last_used = start;
+
+    if (socket->proto == NSAPI_UDP) {
+        ret = _esp.open_udp(socket->id, addr.get_ip_address(), addr.get_port(), socket->sport);
+    } else {
+        ret = _esp.open_tcp(socket->id, addr.get_ip_address(), addr.get_port(), socket->keepalive, socket->ssl);
+        if (ret == NSAPI_ERROR_OK && socket->pooled) {
+            _pool_miss(rtos::Kernel::get_ms_count() - start);
+        }
+    }
+
+    socket->connected = (ret == NSAPI_ERROR_OK) ? true : false;
+    socket->addr = addr;
+
+    return ret;
+}
+
+void ESP8266Interface::_pool_miss(uint32_t ms)
+{
+    // Smoothed, 1/8 weight per sample
+    _link_mutex.lock();
+    _pool_stats.misses++;
+    _pool_stats.connect_ms = _pool_stats.misses == 1 ? ms
+                             : _pool_stats.connect_ms - _pool_stats.connect_ms / 8 + ms / 8;
+    _link_mutex.unlock();
+}
+
+int ESP8266Interface::connect_batch(struct esp8266_connect *conns, unsigned count)
+{
+    if (!conns && count) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    ESP8266::tcp_open *opens = new ESP8266::tcp_open[count];
+    if (!opens) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    int connected = 0;
+    unsigned n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct esp8266_socket *socket = (struct esp8266_socket *)conns[i].handle;
+        conns[i].result = NSAPI_ERROR_OK;
+
+        if (!socket || socket->proto != NSAPI_TCP) {
+            conns[i].result = NSAPI_ERROR_NO_SOCKET;
+            continue;
+        }
+        if (socket->connected) {
+            conns[i].result = NSAPI_ERROR_IS_CONNECTED;
+            continue;
+        }
+
+        // Parked connection needs no handshake
+        if (socket->pooled) {
+            _link_mutex.lock();
+            bool hit = _pool_take(socket, conns[i].addr);
+            if (hit) {
+                _pool_stats.hits++;
+                _pool_stats.saved_ms += _pool_stats.connect_ms;
+            }
+            _link_mutex.unlock();
+            if (hit) {
+                socket->addr = conns[i].addr;
+                socket->connected = true;
+                connected++;
+                continue;
+            }
+        }
+
+        if (socket->id == -1 && _link_attach(socket) != NSAPI_ERROR_OK) {
+            conns[i].result = NSAPI_ERROR_NO_SOCKET;
+            continue;
+        }
+        opens[n].id = socket->id;
+        opens[n].addr = conns[i].addr.get_ip_address();
+        opens[n].port = conns[i].addr.get_port();
+        opens[n].keepalive = socket->keepalive;
+        opens[n].ssl = socket->ssl;
+        n++;
+    }
+
+    _esp.open_tcp_each(opens, n);
+
+    n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct esp8266_socket *socket = (struct esp8266_socket *)conns[i].handle;
+        if (conns[i].result != NSAPI_ERROR_OK || socket->connected) {
+            continue;
+        }
+        conns[i].result = opens[n].result;
+        if (conns[i].result == NSAPI_ERROR_OK && socket->pooled) {
+            _pool_miss(opens[n].ms);
+        }
+        n++;
+        socket->connected = conns[i].result == NSAPI_ERROR_OK;
+        socket->addr = conns[i].addr;
+        socket->last_used = rtos::Kernel::get_ms_count();
+        if (socket->connected) {
+            connected++;
+        }
+    }
+
+    delete[] opens;
+    return connected;
+}
+
+int ESP8266Interface::socket_accept(void *server, void **socket, SocketAddress *addr)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+int ESP8266Interface::socket_send(void *handle, const void *data, unsigned size)
+{
+    nsapi_error_t status;
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    status = _tx_error(socket);
+    if (status != NSAPI_ERROR_OK) {
+        return status;
+    }
+
+    // Connected socket on the shared link sends to its default remote end
+    if (socket->shared) {
+        return socket->addr ? socket_sendto(socket, socket->addr, data, size) : NSAPI_ERROR_NO_ADDRESS;
+    }
+
+    if (socket->proto == NSAPI_TCP) {
+        // Rest is sent with the next call
+        if (size > socket->sndbuf) {
+            size = socket->sndbuf;
+        }
+    } else if (size > socket->sndbuf) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    // Link was handed over to another socket while idle, reopened as with sendto
+    if (socket->id == -1 && socket->proto == NSAPI_UDP && socket->addr) {
+        status = _udp_connect(socket, socket->addr);
+        if (status != NSAPI_ERROR_OK) {
+            return status;
+        }
+    }
+
+    // Pinned, eviction would change the id under the send
+    int id = _link_pin(socket);
+    if (id == -1) {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    socket->last_used = rtos::Kernel::get_ms_count();
+    if (socket->proto == NSAPI_TCP && socket->sndlowat) {
+        int sent = _tx_buffer(socket, data, size);
+        _link_unpin(socket);
+        return sent;
     }
+    status = _esp.send(id, data, size);
+    _link_unpin(socket);
+
+    return status != NSAPI_ERROR_OK ? status : size;
+}
+
+int ESP8266Interface::_tx_buffer(struct esp8266_socket *socket, const void *data, unsigned size)
+{
+    nsapi_error_t status = NSAPI_ERROR_OK;
 
+    _link_mutex.lock();
+    if (socket->tx_len == socket->sndbuf) {
+        status = _tx_flush(socket);
+    }
+
+    unsigned len = socket->sndbuf - socket->tx_len;
+    if (status == NSAPI_ERROR_OK) {
+        len = size < len ? size : len;
+        memcpy(socket->tx_buf + socket->tx_len, data, len);
+        socket->tx_len += len;
+
+        if (socket->tx_len >= socket->sndlowat) {
+            status = _tx_flush(socket);
+        } else if (!_tx_event_id) {
+            // Small writes are held back only for a while
+            _tx_event_id = _queue.call_in(ESP8266_SNDLOWAT_DELAY, this,
+                                                       &ESP8266Interface::_tx_flush_evnt);
+        }
+    }
+    _link_mutex.unlock();
+
+    return status != NSAPI_ERROR_OK ? status : len;
+}
+
+nsapi_error_t ESP8266Interface::_tx_flush(struct esp8266_socket *socket)
+{
+    nsapi_error_t status = NSAPI_ERROR_OK;
+
+    _link_mutex.lock();
+    if (socket->tx_len) {
+        status = socket->id != -1 ? _esp.send(socket->id, socket->tx_buf, socket->tx_len)
+                 : NSAPI_ERROR_NO_CONNECTION;
+    }
+    socket->tx_len = 0;
+    // Data was reported sent already, application learns of the loss with its next call
+    if (status != NSAPI_ERROR_OK) {
+        socket->tx_err = status;
+    }
+    _link_mutex.unlock();
+
+    return status;
+}
+
+nsapi_error_t ESP8266Interface::_tx_error(struct esp8266_socket *socket)
+{
+    _link_mutex.lock();
+    nsapi_error_t err = socket->tx_err;
+    socket->tx_err = NSAPI_ERROR_OK;
+    _link_mutex.unlock();
+
+    return err;
+}
+
+void ESP8266Interface::_tx_flush_evnt()
+{
+    _link_mutex.lock();
+    _tx_event_id = 0;
+    for (struct esp8266_socket *socket = _socks; socket; socket = socket->next) {
+        if (socket->tx_len && _tx_flush(socket) != NSAPI_ERROR_OK && socket->callback) {
+            socket->callback(socket->data);
+        }
+    }
+    _link_mutex.unlock();
+}
+
+nsapi_error_t ESP8266Interface::_tx_resize(struct esp8266_socket *socket, uint32_t sndbuf, uint32_t sndlowat)
+{
+    if (sndbuf < 1 || sndbuf > ESP8266_SNDBUF_MAX || sndlowat > sndbuf) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    _link_mutex.lock();
+    _tx_flush(socket);
+    free(socket->tx_buf);
+    socket->tx_buf = sndlowat ? (uint8_t *)malloc(sndbuf) : 0;
+    socket->sndbuf = sndbuf;
+    socket->sndlowat = socket->tx_buf ? sndlowat : 0; // Sent at once without a buffer
+    _link_mutex.unlock();
+
+    return sndlowat && !socket->tx_buf ? NSAPI_ERROR_NO_MEMORY : NSAPI_ERROR_OK;
+}
+
+int ESP8266Interface::socket_recv(void *handle, void *data, unsigned size)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if (socket->shared) {
+        if (_shared_id == -1 || !socket->addr) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+        uint32_t full_len;
+        int32_t recv = _esp.recv_udp_from(_shared_id, socket->addr.get_ip_address(), socket->addr.get_port(),
+                                          data, size, socket->recv_timeout, &full_len);
+        if (recv >= 0 && full_len > (uint32_t)recv) {
+            socket->rx_truncated++;
+        }
+        return recv;
+    }
+
+    // No link, nothing can arrive
+    int id = _link_pin(socket);
+    if (id == -1) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    // Request held back would leave the reply waiting
+    if (socket->tx_len) {
+        _tx_flush(socket);
+    }
+    nsapi_error_t err = _tx_error(socket);
+    if (err != NSAPI_ERROR_OK) {
+        _link_unpin(socket);
+        return err;
+    }
+
+    int32_t recv;
+    if (socket->proto == NSAPI_TCP) {
+        recv = _esp.recv_tcp(id, data, size, socket->recv_timeout);
+        if (recv <= 0 && recv != NSAPI_ERROR_WOULD_BLOCK) {
+            socket->connected = false;
+        }
+    } else {
+        recv = _esp.recv_udp(id, data, size, socket->recv_timeout);
+        if (recv >= 0 && _esp.rx_full_len(id) > (uint32_t)recv) {
+            socket->rx_truncated++;
+        }
+    }
+    _link_unpin(socket);
+
+    if (recv > 0) {
+        socket->last_used = rtos::Kernel::get_ms_count();
+    }
+
+    return recv;
+}
+
+int ESP8266Interface::socket_sendto(void *handle, const SocketAddress &addr, const void *data, unsigned size)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if((strcmp(addr.get_ip_address(), "0.0.0.0") == 0) || !addr.get_port())  {
+        return NSAPI_ERROR_DNS_FAILURE;
+    }
+
+    if (socket->shared && _shared_claim(socket, addr)) {
+        if (size > socket->sndbuf) {
+            return NSAPI_ERROR_PARAMETER;
+        }
+        ESP8266::udp_send send = { data, size, addr.get_ip_address(), addr.get_port(), NSAPI_ERROR_OK };
+        int done;
+        nsapi_error_t status = _shared_send(addr, &send, 1, &done);
+        if (status != NSAPI_ERROR_OK) {
+            return status;
+        }
+        if (!done) {
+            return send.result;
+        }
+        socket->addr = addr; // Replies from addr are received by this socket
+        _shared_cbs[socket->slot].peer = addr;
+        return size;
+    }
+
+    nsapi_error_t err = _udp_connect(socket, addr);
+    if (err < 0) {
+        return err;
+    }
+
+    return socket_send(socket, data, size);
+}
+
+nsapi_error_t ESP8266Interface::_udp_connect(struct esp8266_socket *socket, const SocketAddress &addr)
+{
     if (socket->connected && socket->addr != addr) {
         if (!_esp.close(socket->id)) {
             return NSAPI_ERROR_DEVICE_ERROR;
@@ -488,7 +1548,94 @@ int ESP8266Interface::socket_sendto(void *handle, const SocketAddress &addr, con
         socket->addr = addr;
     }
 
-    return socket_send(socket, data, size);
+    return NSAPI_ERROR_OK;
+}
+
+int ESP8266Interface::sendto_batch(nsapi_socket_t handle, struct esp8266_sendto *msgs, unsigned count)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if (socket->proto != NSAPI_UDP) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+
+    if (!msgs && count) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    for (unsigned k = 0; socket->shared && k < count; k++) {
+        _shared_claim(socket, msgs[k].addr);
+    }
+
+    ESP8266::udp_send *sends = new ESP8266::udp_send[count];
+    if (!sends) {
+        return NSAPI_ERROR_NO_MEMORY;
+    }
+
+    int sent = 0;
+    unsigned i = 0;
+    while (i < count) {
+        // Mode 0 link has one remote end, its datagrams go in runs of the same destination
+        unsigned n = 0;
+        for (; i + n < count; n++) {
+            struct esp8266_sendto *msg = &msgs[i + n];
+            if (strcmp(msg->addr.get_ip_address(), "0.0.0.0") == 0 || !msg->addr.get_port()
+                    || msg->size > socket->sndbuf
+                    || (!socket->shared && msg->addr != msgs[i].addr)) {
+                break;
+            }
+            sends[n].data = msg->data;
+            sends[n].len = msg->size;
+            sends[n].addr = socket->shared ? msg->addr.get_ip_address() : 0;
+            sends[n].port = msg->addr.get_port();
+        }
+
+        if (n == 0) {
+            msgs[i].result = msgs[i].size > socket->sndbuf ? NSAPI_ERROR_PARAMETER : NSAPI_ERROR_DNS_FAILURE;
+            i++;
+            break;
+        }
+
+        nsapi_error_t status;
+        int done = 0;
+        if (socket->shared) {
+            status = _shared_send(msgs[i].addr, sends, n, &done);
+        } else {
+            status = _udp_connect(socket, msgs[i].addr);
+            if (status == NSAPI_ERROR_OK) {
+                done = _esp.send_udp_batch(socket->id, sends, n);
+            }
+        }
+
+        for (unsigned j = 0; j < n; j++) {
+            msgs[i + j].result = status == NSAPI_ERROR_OK ? sends[j].result
+                                 : j == 0 ? status : NSAPI_ERROR_WOULD_BLOCK;
+        }
+        if (done) {
+            sent += done;
+            socket->addr = msgs[i + done - 1].addr; // Replies from addr are received by this socket
+            if (socket->shared) {
+                _shared_cbs[socket->slot].peer = socket->addr;
+            }
+            socket->last_used = rtos::Kernel::get_ms_count();
+        }
+        i += n;
+        if (done < (int)n) {
+            break;
+        }
+    }
+
+    // Rest were not tried
+    for (; i < count; i++) {
+        msgs[i].result = NSAPI_ERROR_WOULD_BLOCK;
+    }
+
+    delete[] sends;
+    return sent;
 }
 
 int ESP8266Interface::socket_recvfrom(void *handle, SocketAddress *addr, void *data, unsigned size)
@@ -510,8 +1657,15 @@ int ESP8266Interface::socket_recvfrom(void *handle, SocketAddress *addr, void *d
 void ESP8266Interface::socket_attach(void *handle, void (*callback)(void *), void *data)
 {
     struct esp8266_socket *socket = (struct esp8266_socket *)handle;
-    _cbs[socket->id].callback = callback;
-    _cbs[socket->id].data = data;
+    socket->callback = callback;
+    socket->data = data;
+    if (socket->shared) {
+        _shared_cbs[socket->slot].callback = callback;
+        _shared_cbs[socket->slot].data = data;
+    } else if (socket->id != -1) {
+        _cbs[socket->id].callback = callback;
+        _cbs[socket->id].data = data;
+    }
 }
 
 nsapi_error_t ESP8266Interface::setsockopt(nsapi_socket_t handle, int level,
@@ -525,17 +1679,110 @@ nsapi_error_t ESP8266Interface::setsockopt(nsapi_socket_t handle, int level,
         return NSAPI_ERROR_NO_SOCKET;
     }
 
+    if (level == NSAPI_SOCKET && optname == NSAPI_RCVBUF) {
+        if (socket->shared) {
+            return NSAPI_ERROR_UNSUPPORTED; // Link is not the socket's own
+        }
+        if (optlen == sizeof(int) && *(int *)optval >= 0) {
+            _link_mutex.lock();
+            bool done = socket->id == -1 || _esp.set_rcvbuf(socket->id, *(int *)optval);
+            if (done) {
+                socket->rcvbuf = *(int *)optval;
+            }
+            _link_mutex.unlock();
+            return done ? NSAPI_ERROR_OK : NSAPI_ERROR_NO_MEMORY;
+        }
+        return NSAPI_ERROR_PARAMETER;
+    } else if (level == NSAPI_SOCKET && optname == NSAPI_SNDBUF) {
+        if (optlen == sizeof(int) && *(int *)optval > 0) {
+            int size = *(int *)optval;
+            return _tx_resize(socket, size, socket->sndlowat > (uint32_t)size ? size : socket->sndlowat);
+        }
+        return NSAPI_ERROR_PARAMETER;
+    }
+
     if (level == NSAPI_SOCKET && socket->proto == NSAPI_TCP) {
         switch (optname) {
             case NSAPI_KEEPALIVE: {
                 if(socket->connected) {// ESP8266 limitation, keepalive needs to be given before connecting
                     return NSAPI_ERROR_UNSUPPORTED;
                 }
-
+
+                if (optlen == sizeof(int)) {
+                    int secs = *(int *)optval;
+                    if (secs  >= 0 && secs <= 7200) {
+                        socket->keepalive = secs;
+                        return NSAPI_ERROR_OK;
+                    }
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+        }
+    } else if (level == ESP8266_SOCKET) {
+        switch (optname) {
+            case ESP8266_TCP_WEIGHT: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if (optlen == sizeof(int)) {
+                    int weight = *(int *)optval;
+                    if (weight > 0 && weight <= 0xff && _esp.set_tcp_weight(socket->id, weight)) {
+                        socket->weight = weight;
+                        return NSAPI_ERROR_OK;
+                    }
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+            case ESP8266_RCVTIMEO: {
+                if (optlen == sizeof(int)) {
+                    int ms = *(int *)optval;
+                    if (ms >= 0) {
+                        socket->recv_timeout = ms;
+                        return NSAPI_ERROR_OK;
+                    }
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+            case ESP8266_SNDLOWAT: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if (optlen == sizeof(int) && *(int *)optval >= 0) {
+                    return _tx_resize(socket, socket->sndbuf, *(int *)optval);
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+            case ESP8266_TLS: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if (socket->connected) { // Decided on connect
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
                 if (optlen == sizeof(int)) {
-                    int secs = *(int *)optval;
-                    if (secs  >= 0 && secs <= 7200) {
-                        socket->keepalive = secs;
+                    socket->ssl = *(int *)optval != 0;
+                    return NSAPI_ERROR_OK;
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+            case ESP8266_TCP_POOL: {
+                if (socket->proto != NSAPI_TCP || !MBED_CONF_ESP8266_TCP_POOL_SIZE) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if (optlen == sizeof(int)) {
+                    socket->pooled = *(int *)optval != 0;
+                    return NSAPI_ERROR_OK;
+                }
+                return NSAPI_ERROR_PARAMETER;
+            }
+            case ESP8266_IDLE_TIMEOUT: {
+                if (socket->proto != NSAPI_UDP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if (optlen == sizeof(int)) {
+                    int ms = *(int *)optval;
+                    if (ms >= 0) {
+                        socket->idle_timeout = ms;
                         return NSAPI_ERROR_OK;
                     }
                 }
@@ -557,6 +1804,15 @@ nsapi_error_t ESP8266Interface::getsockopt(nsapi_socket_t handle, int level, int
         return NSAPI_ERROR_NO_SOCKET;
     }
 
+    if (level == NSAPI_SOCKET && (optname == NSAPI_RCVBUF || optname == NSAPI_SNDBUF)) {
+        int size = optname == NSAPI_RCVBUF ? socket->rcvbuf : socket->sndbuf;
+        if(*optlen > sizeof(int)) {
+            *optlen = sizeof(int);
+        }
+        memcpy(optval, &size, *optlen);
+        return NSAPI_ERROR_OK;
+    }
+
     if (level == NSAPI_SOCKET && socket->proto == NSAPI_TCP) {
         switch (optname) {
             case NSAPI_KEEPALIVE: {
@@ -567,6 +1823,127 @@ nsapi_error_t ESP8266Interface::getsockopt(nsapi_socket_t handle, int level, int
                 return NSAPI_ERROR_OK;
             }
         }
+    } else if (level == ESP8266_SOCKET) {
+        switch (optname) {
+            case ESP8266_TCP_WEIGHT: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &(socket->weight), *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_RCVTIMEO: {
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &(socket->recv_timeout), *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_SNDLOWAT: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                int lowat = socket->sndlowat;
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &lowat, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_TLS: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                int ssl = socket->ssl;
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &ssl, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_TCP_POOL: {
+                if (socket->proto != NSAPI_TCP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                int pooled = socket->pooled;
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &pooled, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_IDLE_TIMEOUT: {
+                if (socket->proto != NSAPI_UDP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &(socket->idle_timeout), *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_HANDLE: {
+                if(*optlen > sizeof(nsapi_socket_t)) {
+                    *optlen = sizeof(nsapi_socket_t);
+                }
+                memcpy(optval, &handle, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_RX_BYTES:
+            case ESP8266_RX_DATAGRAMS:
+            case ESP8266_RX_PENDING: {
+                int value;
+                if (socket->id == -1) {
+                    value = 0;
+                } else if (optname == ESP8266_RX_BYTES) {
+                    value = _esp.rx_buffered(socket->id);
+                } else if (optname == ESP8266_RX_DATAGRAMS) {
+                    if (socket->proto != NSAPI_UDP) {
+                        return NSAPI_ERROR_UNSUPPORTED;
+                    }
+                    value = _esp.rx_datagrams(socket->id);
+                } else {
+                    if (socket->proto != NSAPI_TCP) {
+                        return NSAPI_ERROR_UNSUPPORTED;
+                    }
+                    value = _esp.tcp_pending(socket->id);
+                    if (value < 0) {
+                        return value;
+                    }
+                }
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &value, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+            case ESP8266_RX_NEXT_LEN:
+            case ESP8266_RX_TRUNCATED: {
+                if (socket->proto != NSAPI_UDP) {
+                    return NSAPI_ERROR_UNSUPPORTED;
+                }
+                int value = socket->rx_truncated;
+                if (optname == ESP8266_RX_NEXT_LEN) {
+                    if (socket->shared) {
+                        value = _shared_id == -1 || !socket->addr ? NSAPI_ERROR_WOULD_BLOCK
+                                : _esp.rx_next_len(_shared_id, socket->addr.get_ip_address(), socket->addr.get_port());
+                    } else {
+                        value = socket->id == -1 ? NSAPI_ERROR_WOULD_BLOCK : _esp.rx_next_len(socket->id);
+                    }
+                    if (value < 0) {
+                        return value;
+                    }
+                }
+                if(*optlen > sizeof(int)) {
+                    *optlen = sizeof(int);
+                }
+                memcpy(optval, &value, *optlen);
+                return NSAPI_ERROR_OK;
+            }
+        }
     }
 
     return NSAPI_ERROR_UNSUPPORTED;
@@ -575,10 +1952,44 @@ nsapi_error_t ESP8266Interface::getsockopt(nsapi_socket_t handle, int level, int
 
 void ESP8266Interface::event()
 {
-    for (int i = 0; i < ESP8266_SOCKET_COUNT; i++) {
-        if (_cbs[i].callback) {
-            _cbs[i].callback(_cbs[i].data);
+    // Serial port has data, parse it in thread context. Sockets are signaled only once data for them
+    // has been parsed, see socket_event().
+    if (!_oob_event_id) {
+        _oob_event_id = _queue.call(this, &ESP8266Interface::proc_oob_evnt);
+    }
+}
+
+void ESP8266Interface::proc_oob_evnt()
+{
+    _oob_event_id = 0; // Allows creating new events
+    // Sigio is raised for TX room too, nothing to parse then
+    if (!_esp.readable()) {
+        return;
+    }
+    _esp.bg_process_oob(ESP8266_RECV_TIMEOUT, true);
+}
+
+void ESP8266Interface::socket_event(int id)
+{
+    if (id == _shared_id) {
+        // Datagrams wake up the socket of their remote end, other events everyone
+        bool data = _esp.rx_buffered(id) != 0;
+        for (int i = 0; i < ESP8266_UDP_SHARED_SOCKETS; i++) {
+            const SocketAddress &peer = _shared_cbs[i].peer;
+            if (!_shared_cbs[i].callback) {
+                continue;
+            }
+            if (data && (!peer || _esp.rx_next_len(id, peer.get_ip_address(), peer.get_port())
+                                  == NSAPI_ERROR_WOULD_BLOCK)) {
+                continue;
+            }
+            _shared_cbs[i].callback(_shared_cbs[i].data);
         }
+        return;
+    }
+
+    if (_cbs[id].callback) {
+        _cbs[id].callback(_cbs[id].data);
     }
 }
 
@@ -592,6 +2003,94 @@ nsapi_connection_status_t ESP8266Interface::get_connection_status() const
     return _conn_stat;
 }
 
+int ESP8266Interface::recv_batch(nsapi_socket_t handle, ESP8266::udp_datagram *msgs, unsigned count)
+{
+    struct esp8266_socket *socket = (struct esp8266_socket *)handle;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    if (socket->proto != NSAPI_UDP) {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+
+    int recv;
+    if (socket->shared) {
+        if (_shared_id == -1 || !socket->addr) {
+            return NSAPI_ERROR_WOULD_BLOCK;
+        }
+        recv = _esp.recv_udp_batch(_shared_id, msgs, count, socket->recv_timeout,
+                                   socket->addr.get_ip_address(), socket->addr.get_port());
+    } else if (socket->id == -1) {
+        return NSAPI_ERROR_WOULD_BLOCK;
+    } else {
+        recv = _esp.recv_udp_batch(socket->id, msgs, count, socket->recv_timeout);
+    }
+
+    for (int i = 0; i < recv; i++) {
+        if (msgs[i].len > msgs[i].size) {
+            socket->rx_truncated++;
+        }
+    }
+
+    if (recv > 0) {
+        socket->last_used = rtos::Kernel::get_ms_count();
+    }
+
+    return recv;
+}
+
+int ESP8266Interface::poll(struct esp8266_pollfd *fds, unsigned nfds, uint32_t timeout)
+{
+    uint32_t interest = 0;
+
+    if (!fds && nfds) {
+        return NSAPI_ERROR_PARAMETER;
+    }
+
+    for (unsigned i = 0; i < nfds; i++) {
+        struct esp8266_socket *socket = (struct esp8266_socket *)fds[i].handle;
+        if (!socket) {
+            return NSAPI_ERROR_NO_SOCKET;
+        }
+        int id = socket->shared ? _shared_id : socket->id;
+        if (id != -1) {
+            interest |= ESP8266::poll_mask(id, fds[i].events);
+        } else if (fds[i].events & ESP8266::POLLOUT) {
+            timeout = 0; // Link is taken back on send
+        }
+    }
+
+    uint32_t ready = _esp.poll(interest, timeout);
+
+    int count = 0;
+    for (unsigned i = 0; i < nfds; i++) {
+        struct esp8266_socket *socket = (struct esp8266_socket *)fds[i].handle;
+        int id = socket->shared ? _shared_id : socket->id;
+        if (id != -1) {
+            fds[i].revents = ESP8266::poll_events(id, ready) & fds[i].events;
+        } else {
+            fds[i].revents = fds[i].events & ESP8266::POLLOUT;
+        }
+        if (fds[i].revents) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+ESP8266::recv_mode_stats ESP8266Interface::get_tcp_recv_mode_stats()
+{
+    return _esp.tcp_recv_mode_stats();
+}
+
+ESP8266::wakeup_stats ESP8266Interface::get_recv_wakeup_stats()
+{
+    return _esp.recv_wakeup_stats();
+}
+
 #if MBED_CONF_ESP8266_PROVIDE_DEFAULT
 
 WiFiInterface *WiFiInterface::get_default_instance() {
@@ -608,12 +2107,26 @@ void ESP8266Interface::update_conn_state_cb()
     switch(_conn_stat) {
         // Doesn't require changes
         case NSAPI_STATUS_CONNECTING:
+            break;
         case NSAPI_STATUS_GLOBAL_UP:
+            _reconnect_done();
             break;
         // Start from scratch if connection drops/is dropped
         case NSAPI_STATUS_DISCONNECTED:
-            _started = false;
-            _initialized = false;
+            if (_esp.watchdog_reset_detected()) {
+                // Modem lost its configuration, replay it before rejoining
+                _reconnect_setup = true;
+                _reconnect_stats.resets++;
+            }
+            if (_roam_switching) {
+                // Leaving the old access point, see _roam()
+            } else if (_auto_reconnect && _started) {
+                // Modem keeps its configuration unless reset, rejoin without a reset of our own
+                _reconnect_schedule();
+            } else {
+                _started = false;
+                _initialized = false;
+            }
             break;
         // Handled on AT layer
         case NSAPI_STATUS_LOCAL_UP:
@@ -627,3 +2140,277 @@ void ESP8266Interface::update_conn_state_cb()
         _conn_stat_cb(NSAPI_EVENT_CONNECTION_STATUS_CHANGE, _conn_stat);
     }
 }
+
+void ESP8266Interface::set_auto_reconnect(bool enabled)
+{
+    _auto_reconnect = enabled;
+    if (!enabled) {
+        _reconnect_cancel();
+    }
+}
+
+ESP8266Interface::reconnect_stats ESP8266Interface::get_reconnect_stats() const
+{
+    return _reconnect_stats;
+}
+
+void ESP8266Interface::set_roaming(bool enabled, int8_t rssi_threshold)
+{
+    _roam_threshold = rssi_threshold;
+    _roam_enabled = enabled;
+    if (enabled) {
+        _roam_schedule();
+    } else if (_roam_event_id) {
+        _queue.cancel(_roam_event_id);
+        _roam_event_id = 0;
+    }
+}
+
+ESP8266Interface::roam_stats ESP8266Interface::get_roam_stats() const
+{
+    return _roam_stats;
+}
+
+void ESP8266Interface::_roam_schedule()
+{
+    if (!_roam_event_id) {
+        _roam_event_id = _queue.call_in(ESP8266_ROAM_INTERVAL, this, &ESP8266Interface::_roam_check);
+    }
+}
+
+void ESP8266Interface::_roam_check()
+{
+    _roam_event_id = 0;
+    if (!_roam_enabled) {
+        return;
+    }
+
+    if (_started && !_roam_active && _conn_stat == NSAPI_STATUS_GLOBAL_UP) {
+        _roam_stats.checks++;
+        if (_esp.ap_info(_roam_ssid, _roam_bssid, &_roam_rssi) && _roam_rssi < _roam_threshold) {
+            // Only worth it with a clearly stronger one
+            _roam_found = false;
+            _roam_target_rssi = _roam_rssi + ESP8266_ROAM_HYSTERESIS;
+            _roam_active = true;
+            if (_esp.scan_async(callback(this, &ESP8266Interface::_roam_scan_result), _roam_ssid)
+                    == NSAPI_ERROR_OK) {
+                _roam_stats.scans++;
+                return; // Scheduled again once the scan is over
+            }
+            _roam_active = false;
+        }
+    }
+
+    _roam_schedule();
+}
+
+void ESP8266Interface::_roam_scan_result(const WiFiAccessPoint *ap, int status)
+{
+    // Called from OOB processing, driver can't be used here
+    if (!ap) {
+        _queue.call(this, &ESP8266Interface::_roam);
+        return;
+    }
+
+    if (memcmp(ap->get_bssid(), _roam_bssid, sizeof(_roam_bssid)) != 0 && ap->get_rssi() >= _roam_target_rssi) {
+        memcpy(_roam_target, ap->get_bssid(), sizeof(_roam_target));
+        _roam_target_rssi = ap->get_rssi();
+        _roam_found = true;
+    }
+}
+
+void ESP8266Interface::_roam()
+{
+    // Application's connect() or disconnect() in progress, its outcome stands
+    if (!_conn_mutex.trylock()) {
+        _roam_active = false;
+        _roam_schedule();
+        return;
+    }
+
+    // Credentials are known only for the network joined last. Join runs in the background so
+    // socket data keeps being processed, links stay up in case modem stays on the old access point.
+    if (_roam_found && _roam_enabled && _started && strcmp(_roam_ssid, ap_ssid) == 0) {
+        _roam_start = rtos::Kernel::get_ms_count();
+        _roam_switching = true;
+        if (_esp.connect_async(ap_ssid, ap_pass, _roam_target,
+                               callback(this, &ESP8266Interface::_roam_joined)) == NSAPI_ERROR_OK) {
+            _conn_mutex.unlock();
+            return; // Finished by _roam_done
+        }
+        _roam_switching = false;
+        _roam_stats.failures++;
+    }
+
+    _conn_mutex.unlock();
+    _roam_active = false;
+    _roam_schedule();
+}
+
+void ESP8266Interface::_roam_joined(nsapi_error_t status)
+{
+    // Called from OOB processing, driver can't be used here
+    _queue.call(this, &ESP8266Interface::_roam_done, status);
+}
+
+void ESP8266Interface::_roam_done(nsapi_error_t status)
+{
+    _roam_switching = false;
+    uint32_t roam_ms = rtos::Kernel::get_ms_count() - _roam_start;
+    _ap_history_update(_roam_target, status == NSAPI_ERROR_OK);
+
+    if (status == NSAPI_ERROR_OK) {
+        // Links didn't survive leaving the old access point
+        _esp.drop_links();
+        _roam_stats.roams++;
+        _roam_stats.last_roam_ms = roam_ms;
+        if (roam_ms > _roam_stats.max_roam_ms) {
+            _roam_stats.max_roam_ms = roam_ms;
+        }
+        _roam_stats.rssi_before = _roam_rssi;
+        _roam_stats.rssi_after = _roam_target_rssi;
+        char ssid[ESP8266_SSID_MAX_LENGTH + 1];
+        uint8_t bssid[6];
+        _esp.ap_info(ssid, bssid, &_roam_stats.rssi_after);
+    } else {
+        _roam_stats.failures++;
+        // Unless modem stayed on the old access point, handle as a dropped connection
+        if (_conn_stat != NSAPI_STATUS_GLOBAL_UP) {
+            _esp.drop_links();
+            if (_auto_reconnect && _started) {
+                _reconnect_schedule();
+            } else {
+                _started = false;
+                _initialized = false;
+            }
+        }
+    }
+
+    _roam_active = false;
+    _roam_schedule();
+}
+
+void ESP8266Interface::_reconnect_schedule()
+{
+    if (_reconnect_event_id) {
+        return;
+    }
+
+    if (!_reconnect_down_ms) {
+        _reconnect_down_ms = rtos::Kernel::get_ms_count();
+        _reconnect_backoff = ESP8266_RECONNECT_BACKOFF_MIN;
+        _reconnect_stats.disconnects++;
+    }
+
+    // Random share on top of the backoff keeps a fleet that lost the same AP from rejoining in lockstep
+    int delay = _reconnect_backoff + _random() % (_reconnect_backoff / 2 + 1);
+    _reconnect_event_id = _queue.call_in(delay, this, &ESP8266Interface::_reconnect);
+}
+
+void ESP8266Interface::_random_seed()
+{
+    if (_rand_state) {
+        return;
+    }
+
+    // rand() would start from the same seed on every device, MAC differs and
+    // boot time varies with the modem's startup
+    const char *mac = _esp.mac_addr();
+    uint32_t seed = 2166136261u;
+    for (const char *p = mac; p && *p; p++) {
+        seed = (seed ^ (uint8_t)*p) * 16777619u;
+    }
+    seed ^= (uint32_t)rtos::Kernel::get_ms_count();
+    _rand_state = seed ? seed : 1;
+}
+
+uint32_t ESP8266Interface::_random()
+{
+    // xorshift32, state never reaches 0
+    if (!_rand_state) {
+        _rand_state = (uint32_t)rtos::Kernel::get_ms_count() | 1;
+    }
+    _rand_state ^= _rand_state << 13;
+    _rand_state ^= _rand_state >> 17;
+    _rand_state ^= _rand_state << 5;
+    return _rand_state;
+}
+
+void ESP8266Interface::_reconnect()
+{
+    _reconnect_event_id = 0;
+
+    // Modem might have rejoined on its own
+    if (_conn_stat == NSAPI_STATUS_GLOBAL_UP || !_started) {
+        return;
+    }
+
+    _reconnect_stats.attempts++;
+    if (!_reconnect_setup || _restore() == NSAPI_ERROR_OK) {
+        _reconnect_setup = false;
+        _esp.connect(ap_ssid, ap_pass);
+    }
+
+    // Rejoined, "WIFI GOT IP" during the attempt already closed the outage, see _reconnect_done()
+    if (_conn_stat == NSAPI_STATUS_GLOBAL_UP || !_reconnect_down_ms) {
+        return;
+    }
+
+    _reconnect_backoff = _reconnect_backoff * 2 > ESP8266_RECONNECT_BACKOFF_MAX ?
+        ESP8266_RECONNECT_BACKOFF_MAX : _reconnect_backoff * 2;
+    _reconnect_schedule();
+}
+
+nsapi_error_t ESP8266Interface::_restore()
+{
+    // Same as _init() and connect() up to joining the AP, without AT+RST and firmware checks
+    if (!_esp.at_available()) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_esp.stop_uart_hw_flow_ctrl()) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_esp.start_uart_hw_flow_ctrl()) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_esp.startup(ESP8266::WIFIMODE_STATION)) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_esp.cond_enable_tcp_passive_mode()) {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_esp.dhcp(true, 1)) {
+        return NSAPI_ERROR_DHCP_FAILURE;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+void ESP8266Interface::_reconnect_done()
+{
+    if (!_reconnect_down_ms) {
+        return;
+    }
+
+    if (_reconnect_event_id) {
+        _queue.cancel(_reconnect_event_id);
+        _reconnect_event_id = 0;
+    }
+
+    uint32_t recovery = rtos::Kernel::get_ms_count() - _reconnect_down_ms;
+    _reconnect_down_ms = 0;
+    _reconnect_stats.recoveries++;
+    _reconnect_stats.last_recovery_ms = recovery;
+    if (recovery > _reconnect_stats.max_recovery_ms) {
+        _reconnect_stats.max_recovery_ms = recovery;
+    }
+}
+
+void ESP8266Interface::_reconnect_cancel()
+{
+    if (_reconnect_event_id) {
+        _queue.cancel(_reconnect_event_id);
+        _reconnect_event_id = 0;
+    }
+    _reconnect_down_ms = 0;
+    _reconnect_setup = false;
+}
@@ -23,6 +23,116 @@
 
 #define ESP8266_SOCKET_COUNT 5
 
+// Backoff limits for rejoining the AP after connection has dropped
+#ifndef ESP8266_RECONNECT_BACKOFF_MIN
+#define ESP8266_RECONNECT_BACKOFF_MIN 1000
+#endif
+#ifndef ESP8266_RECONNECT_BACKOFF_MAX
+#define ESP8266_RECONNECT_BACKOFF_MAX 60000
+#endif
+
+// Credentials connect() chooses from, see add_credentials
+#ifndef ESP8266_CREDENTIALS_MAX
+#define ESP8266_CREDENTIALS_MAX 4
+#endif
+
+// Age in ms of scan results connect() chooses an access point from without scanning
+#ifndef ESP8266_AP_SELECT_MAX_AGE
+#define ESP8266_AP_SELECT_MAX_AGE 30000
+#endif
+
+// dB added to access point's RSSI per past join, subtracted twice per failed one
+#ifndef ESP8266_AP_HISTORY_WEIGHT
+#define ESP8266_AP_HISTORY_WEIGHT 5
+#endif
+
+// Access points whose past joins are remembered
+#ifndef ESP8266_AP_HISTORY_SIZE
+#define ESP8266_AP_HISTORY_SIZE 8
+#endif
+
+// Roaming, see set_roaming
+#ifndef ESP8266_ROAM_INTERVAL
+#define ESP8266_ROAM_INTERVAL 10000
+#endif
+#ifndef ESP8266_ROAM_RSSI_THRESHOLD
+#define ESP8266_ROAM_RSSI_THRESHOLD -75
+#endif
+#ifndef ESP8266_ROAM_HYSTERESIS
+#define ESP8266_ROAM_HYSTERESIS 8
+#endif
+
+// UDP sockets that can share one link, see "esp8266.udp-shared-link"
+#ifndef ESP8266_UDP_SHARED_SOCKETS
+#define ESP8266_UDP_SHARED_SOCKETS 8
+#endif
+
+// Max data modem takes with one AT+CIPSEND, default NSAPI_SNDBUF
+#define ESP8266_SNDBUF_MAX 2048
+
+// Time in ms data below ESP8266_SNDLOWAT is held back at most
+#ifndef ESP8266_SNDLOWAT_DELAY
+#define ESP8266_SNDLOWAT_DELAY 20
+#endif
+
+// Driver's own thread, runs OOB processing, rejoin, roaming and held back sends
+#ifndef ESP8266_THREAD_STACK_SIZE
+#define ESP8266_THREAD_STACK_SIZE 2048
+#endif
+#ifndef ESP8266_EVENT_QUEUE_SIZE
+#define ESP8266_EVENT_QUEUE_SIZE 8
+#endif
+
+/** Socket option level for ESP8266 specific options
+ *
+ *  Used as level with setsockopt and getsockopt
+ */
+#define ESP8266_SOCKET 8266
+
+/** ESP8266 specific socket options
+ */
+typedef enum esp8266_socket_option {
+    ESP8266_TCP_WEIGHT, /*!< Share of passive mode TCP data fetched for the socket, 1-16 [int] */
+    ESP8266_RCVTIMEO,   /*!< Time in ms receive sleeps in driver waiting for data, 0 returns immediately [int] */
+    ESP8266_HANDLE,     /*!< Socket's handle for ESP8266Interface specific calls, getsockopt only [nsapi_socket_t] */
+    ESP8266_RX_BYTES,   /*!< Bytes buffered in driver, readable without waiting, getsockopt only [int] */
+    ESP8266_RX_DATAGRAMS, /*!< Datagrams buffered in driver, UDP only, getsockopt only [int] */
+    ESP8266_RX_PENDING, /*!< Bytes waiting on modem, TCP passive mode only, getsockopt only [int] */
+    ESP8266_IDLE_TIMEOUT, /*!< Idle time in ms after which UDP socket's link may be handed over, 0 never [int] */
+    ESP8266_TCP_POOL,   /*!< Park connection on close, reused by a later connect to the same address, 0 or 1 [int] */
+    ESP8266_TLS,        /*!< Encrypted TCP connection with modem's SSL, server's certificate is not verified, set before connect, 0 or 1 [int] */
+    ESP8266_SNDLOWAT,   /*!< TCP data held back until this many bytes are written, up to NSAPI_SNDBUF, 0 sends at once [int] */
+    ESP8266_RX_NEXT_LEN, /*!< Length of next buffered datagram, UDP only, getsockopt only, NSAPI_ERROR_WOULD_BLOCK if none [int] */
+    ESP8266_RX_TRUNCATED, /*!< Datagrams truncated to the receive buffer since open, UDP only, getsockopt only [int] */
+} esp8266_socket_option_t;
+
+/** Socket and events for ESP8266Interface::poll
+ */
+struct esp8266_pollfd {
+    nsapi_socket_t handle; /*!< Socket handle, see ESP8266_HANDLE */
+    uint32_t events;       /*!< Events to wait for, bitwise or of ESP8266::POLLIN, POLLOUT and POLLHUP */
+    uint32_t revents;      /*!< Events that occurred, set by poll */
+};
+
+/** Socket and address for ESP8266Interface::connect_batch
+ */
+struct esp8266_connect {
+    nsapi_socket_t handle; /*!< TCP socket handle, see ESP8266_HANDLE */
+    SocketAddress addr;    /*!< Address to connect to, IP address resolved */
+    nsapi_error_t result;  /*!< NSAPI_ERROR_OK or negative error code, set by connect_batch */
+};
+
+/** Datagram for ESP8266Interface::sendto_batch
+ */
+struct esp8266_sendto {
+    SocketAddress addr;    /*!< Destination, IP address resolved */
+    const void *data;      /*!< Datagram to send */
+    unsigned size;         /*!< Size of data, up to NSAPI_SNDBUF */
+    nsapi_error_t result;  /*!< NSAPI_ERROR_OK or negative error code, set by sendto_batch */
+};
+
+struct esp8266_socket;
+
 /** ESP8266Interface class
  *  Implementation of the NetworkStack for the ESP8266
  */
@@ -132,6 +242,61 @@ public:
      */
     virtual int scan(WiFiAccessPoint *res, unsigned count);
 
+    /** Scan for networks of one SSID and/or channel
+     *
+     * Modem looks only for the given networks, which takes a fraction of a full scan.
+     *
+     * @param  ap       Pointer to allocated array to store discovered AP
+     * @param  count    Size of allocated @a res array, or 0 to only count available AP
+     * @param  ssid     Only networks of this SSID, null for all
+     * @param  channel  Only this channel, 0 for all
+     * @return          Number of entries in @a, or if @a count was 0 number of available networks, negative on error
+     *                  see @a nsapi_error
+     */
+    int scan(WiFiAccessPoint *res, unsigned count, const char *ssid, uint8_t channel = 0);
+
+    /** Scan for available networks, reusing results of a recent scan
+     *
+     * Driver remembers up to ESP8266_SCAN_CACHE_SIZE access points from every scan. They are
+     * returned without scanning if a full scan completed within @a max_age_ms.
+     *
+     * @param  ap         Pointer to allocated array to store discovered AP
+     * @param  count      Size of allocated @a res array, or 0 to only count available AP
+     * @param  max_age_ms Oldest full scan in milliseconds the results may come from
+     * @param  ssid       Only networks of this SSID, null for all
+     * @param  channel    Only this channel, 0 for all
+     * @return            Number of entries in @a, or if @a count was 0 number of available networks, negative on error
+     *                    see @a nsapi_error
+     */
+    int scan_cached(WiFiAccessPoint *res, unsigned count, uint32_t max_age_ms, const char *ssid = 0,
+                    uint8_t channel = 0);
+
+    /** Scan for available networks without blocking
+     *
+     * Each access point found is passed to the callback as soon as it is parsed, the last call
+     * has a null access point and the number of networks found, or a negative error code.
+     * Callback runs in driver's context and must not call the driver. Buffered socket data
+     * stays readable during the scan, operations needing the modem wait for its end.
+     *
+     * @param  cb       Called with each access point and when the scan is over
+     * @param  ssid     Only networks of this SSID, null for all
+     * @param  channel  Only this channel, 0 for all
+     * @return          NSAPI_ERROR_OK if the scan was started, negative error code on failure
+     */
+    nsapi_error_t scan_async(mbed::Callback<void(const WiFiAccessPoint *, int)> cb, const char *ssid = 0,
+                             uint8_t channel = 0);
+
+    /** Select the fields and order of scan results
+     *
+     * Fields left out are not sent by the modem, they read as zero or NSAPI_SECURITY_UNKNOWN.
+     *
+     * @param  sort     true to list access points strongest first
+     * @param  mask     Bitwise or of ESP8266::SCAN_ECN, SCAN_SSID, SCAN_RSSI, SCAN_MAC, SCAN_CHANNEL,
+     *                  SCAN_FREQ_OFFSET and SCAN_FREQ_CAL
+     * @return          NSAPI_ERROR_OK on success, negative error code on failure
+     */
+    nsapi_error_t set_scan_options(bool sort, uint16_t mask);
+
     /** Translates a hostname to an IP address with specific version
      *
      *  The hostname may be either a domain name or an IP address. If the
@@ -209,6 +374,232 @@ public:
      */
     virtual nsapi_connection_status_t get_connection_status() const;
 
+    /** Add network to the credentials connect() chooses from
+     *
+     *  With credentials added, connect() joins the best access point of any of them: highest RSSI,
+     *  adjusted by ESP8266_AP_HISTORY_WEIGHT dB per past success and twice that per past failure to
+     *  join it. Scan results up to ESP8266_AP_SELECT_MAX_AGE ms old are used, a scan is made only
+     *  without them. Access point is joined by its BSSID, next best ones are tried if it fails.
+     *  Networks not seen in the scan, hidden ones for example, are tried last without a BSSID.
+     *  Credentials of set_credentials are not used while the list is not empty.
+     *
+     *  @param ssid      Name of the network
+     *  @param pass      Security passphrase of the network
+     *  @param security  Type of encryption of the network
+     *  @return          NSAPI_ERROR_OK on success, NSAPI_ERROR_NO_MEMORY if ESP8266_CREDENTIALS_MAX
+     *                   are already added, negative error code on failure
+     */
+    nsapi_error_t add_credentials(const char *ssid, const char *pass,
+                                  nsapi_security_t security = NSAPI_SECURITY_NONE);
+
+    /** Remove all credentials added with add_credentials
+     */
+    void clear_credentials();
+
+    /** Rejoin the AP automatically if connection drops
+     *
+     *  When enabled, a dropped connection is rejoined with the stored credentials without resetting
+     *  the modem. If the modem was reset by its watchdog, its configuration is replayed first and
+     *  sockets open at the time fail with NSAPI_ERROR_CONNECTION_LOST. Attempts are spaced with
+     *  exponential backoff between ESP8266_RECONNECT_BACKOFF_MIN and ESP8266_RECONNECT_BACKOFF_MAX
+     *  milliseconds, with random jitter. disconnect() stops them.
+     *
+     *  @param enabled  true to rejoin automatically, false by default
+     */
+    void set_auto_reconnect(bool enabled);
+
+    /** Automatic rejoin statistics
+     *
+     *  @param disconnects      Connection drops handled
+     *  @param attempts         Rejoin attempts made
+     *  @param recoveries       Connection drops recovered from, also counting modem's own rejoins
+     *  @param last_recovery_ms Time from drop to IP address, last recovery
+     *  @param max_recovery_ms  Longest time from drop to IP address
+     *  @param resets           Modem's watchdog resets recovered from
+     */
+    struct reconnect_stats {
+        uint32_t disconnects;
+        uint32_t attempts;
+        uint32_t recoveries;
+        uint32_t last_recovery_ms;
+        uint32_t max_recovery_ms;
+        uint32_t resets;
+    };
+
+    /** Get automatic rejoin statistics
+     *
+     *  @return         reconnect_stats
+     */
+    reconnect_stats get_reconnect_stats() const;
+
+    /** Move to a stronger access point of the same network in the background
+     *
+     *  RSSI is checked with AT+CWJAP_CUR? every ESP8266_ROAM_INTERVAL ms. Below @a rssi_threshold
+     *  the network's SSID is scanned without blocking sockets, see scan_async. An access point at
+     *  least ESP8266_ROAM_HYSTERESIS dB stronger is joined by its BSSID, socket data keeps being
+     *  processed meanwhile. Modem closes its links when leaving the access point, so once the join
+     *  succeeds, or fails with the old access point lost, sockets open at the time get their
+     *  callback and report NSAPI_ERROR_CONNECTION_LOST, to be reopened by the application. A failed
+     *  join that leaves modem on the old access point keeps them.
+     *
+     *  @param enabled          true to roam, false by default
+     *  @param rssi_threshold   RSSI in dBm below which a stronger access point is looked for
+     */
+    void set_roaming(bool enabled, int8_t rssi_threshold = ESP8266_ROAM_RSSI_THRESHOLD);
+
+    /** Roaming statistics
+     *
+     *  Throughput is not measured by the driver, RSSI before and after the last roam stands for it.
+     *
+     *  @param checks           RSSI checks made
+     *  @param scans            Scans for a stronger access point
+     *  @param roams            Access point changes
+     *  @param failures         Failed attempts to join a stronger access point
+     *  @param last_roam_ms     Time joining the new access point took, last roam
+     *  @param max_roam_ms      Longest time joining a new access point took
+     *  @param rssi_before      RSSI before the last roam
+     *  @param rssi_after       RSSI after the last roam
+     */
+    struct roam_stats {
+        uint32_t checks;
+        uint32_t scans;
+        uint32_t roams;
+        uint32_t failures;
+        uint32_t last_roam_ms;
+        uint32_t max_roam_ms;
+        int8_t rssi_before;
+        int8_t rssi_after;
+    };
+
+    /** Get roaming statistics
+     *
+     *  @return         roam_stats
+     */
+    roam_stats get_roam_stats() const;
+
+    /** Resynchronize socket tables with modem's links
+     *
+     *  Queries modem's links with AT+CIPSTATUS. Sockets whose link is gone are reported closed,
+     *  links no socket owns are closed on modem. Done automatically when modem's replies can't be
+     *  pinpointed to a socket.
+     *
+     *  @return         0 on success, negative error code on failure
+     */
+    nsapi_error_t sync_sockets();
+
+    /** Get number of idle UDP links handed over to other sockets
+     *
+     *  When all links are in use, the link of the UDP socket idle longest past its
+     *  ESP8266_IDLE_TIMEOUT is closed and given to the socket being opened or used. The
+     *  socket gets a link back on its next send. Default timeout is "esp8266.socket-idle-timeout".
+     *
+     *  @return         Number of links handed over
+     */
+    uint32_t get_socket_evictions() const;
+
+    /** Set size of modem's SSL buffer
+     *
+     *  Used by TCP sockets with ESP8266_TLS set, modem supports one such connection at a time.
+     *  Default is "esp8266.ssl-bufsize".
+     *
+     *  @note Modem's SSL encrypts the connection but does not verify server's certificate, the
+     *        peer is not authenticated. Anyone on the path can pose as the server.
+     *
+     *  @param size     Buffer size in bytes, 2048-4096
+     *  @return         0 on success, negative error code on failure
+     */
+    nsapi_error_t set_ssl_buffer_size(int size);
+
+    /** TCP connection pool statistics
+     *
+     *  Hit rate is hits / (hits + misses).
+     *
+     *  @param hits         Connects served by a parked connection
+     *  @param misses       Connects of pooled sockets that opened a new connection
+     *  @param parked       Connections parked on close
+     *  @param connect_ms   Smoothed time opening a new connection takes
+     *  @param saved_ms     Connect time saved by hits, estimated with connect_ms
+     */
+    struct tcp_pool_stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t parked;
+        uint32_t connect_ms;
+        uint32_t saved_ms;
+    };
+
+    /** Get TCP connection pool statistics
+     *
+     *  Sockets take part with ESP8266_TCP_POOL, up to "esp8266.tcp-pool-size" connections are
+     *  kept parked. Parked connections are closed first when links run out.
+     *
+     *  @return         tcp_pool_stats
+     */
+    tcp_pool_stats get_tcp_pool_stats() const;
+
+    /** Connect several TCP sockets with one call
+     *
+     *  Convenience wrapper, connections are opened one after another with the AT command interface
+     *  held throughout and parked connections are reused as with connect. Modem makes the handshakes
+     *  one at a time, so this takes as long as separate connect calls.
+     *
+     *  @param conns    Sockets and addresses, result of each filled in on return
+     *  @param count    Number of entries in conns
+     *  @return         Number of sockets connected, negative error code on failure
+     */
+    int connect_batch(struct esp8266_connect *conns, unsigned count);
+
+    /** Send several datagrams from a UDP socket at once
+     *
+     *  AT+CIPSEND exchanges run back to back with the AT command interface held. A socket sharing
+     *  the mode 2 link may send to different remote ends in one call, others are reconnected
+     *  between runs of datagrams to the same destination. Sending stops at the first failure,
+     *  datagrams after it get NSAPI_ERROR_WOULD_BLOCK as result.
+     *
+     *  @param handle   UDP socket handle, see ESP8266_HANDLE
+     *  @param msgs     Datagrams and destinations, result of each filled in on return
+     *  @param count    Number of entries in msgs
+     *  @return         Number of datagrams sent, negative error code on failure
+     */
+    int sendto_batch(nsapi_socket_t handle, struct esp8266_sendto *msgs, unsigned count);
+
+    /** Receive several datagrams from a UDP socket at once
+     *
+     *  Waits up to socket's ESP8266_RCVTIMEO for the first datagram, the rest are those already
+     *  buffered. Datagrams longer than their buffer are truncated, len tells the full length.
+     *
+     *  @param handle   UDP socket handle, see ESP8266_HANDLE
+     *  @param msgs     Buffers, one datagram each, len filled in on return
+     *  @param count    Number of entries in msgs
+     *  @return         Number of datagrams received, negative error code on failure
+     */
+    int recv_batch(nsapi_socket_t handle, ESP8266::udp_datagram *msgs, unsigned count);
+
+    /** Wait for sockets to become readable, writable or closed
+     *
+     *  Waits on all given sockets at once, one wakeup is enough to tell which of them are ready.
+     *
+     *  @param fds      Sockets and events of interest, revents filled in on return
+     *  @param nfds     Number of entries in fds
+     *  @param timeout  Time to wait in milliseconds, 0 to return immediately
+     *  @return         Number of sockets with events, 0 on timeout, negative error code on failure
+     */
+    int poll(struct esp8266_pollfd *fds, unsigned nfds, uint32_t timeout);
+
+    /** Get TCP receive mode transition counters
+     *
+     *  Counters are updated only with "esp8266.tcp-adaptive-recv-mode" enabled
+     *
+     *  @return         Number of switches to passive mode and back to active mode
+     */
+    ESP8266::recv_mode_stats get_tcp_recv_mode_stats();
+
+    /** Get statistics of receives that slept in driver waiting for data
+     *
+     *  @return         Number of wakeups and time from data arrival to return
+     */
+    ESP8266::wakeup_stats get_recv_wakeup_stats();
+
 protected:
     /** Open a socket
      *  @param handle       Handle in which to store new socket
@@ -330,12 +721,90 @@ private:
     char ap_pass[ESP8266_PASSPHRASE_MAX_LENGTH + 1]; /* The longest possible passphrase; +1 for the \0 */
     nsapi_security_t _ap_sec;
 
+    // Credentials list, see add_credentials
+    struct ap_credential {
+        char ssid[ESP8266_SSID_MAX_LENGTH + 1];
+        char pass[ESP8266_PASSPHRASE_MAX_LENGTH + 1];
+        nsapi_security_t sec;
+    } _creds[ESP8266_CREDENTIALS_MAX];
+    unsigned _creds_len;
+
+    // Access point of a listed network seen in a scan
+    struct ap_candidate {
+        unsigned cred;
+        uint8_t bssid[6];
+        int score;
+    };
+    int _ap_candidates(struct ap_candidate *cands, unsigned max);
+    Mutex _conn_mutex; // Held by connect() and disconnect()
+    nsapi_error_t _connect();
+    nsapi_error_t _connect_best();
+    nsapi_error_t _connect_cred(unsigned cred, const uint8_t *bssid);
+
+    // Outcome of past joins per access point
+    struct {
+        uint8_t bssid[6];
+        int8_t history; // Successes minus twice the failures, limited to +-4
+    } _ap_hist[ESP8266_AP_HISTORY_SIZE];
+    unsigned _ap_hist_next;
+    int _ap_history(const uint8_t *bssid);
+    void _ap_history_update(const uint8_t *bssid, bool joined);
+
     // Drivers's socket info
     struct _sock_info {
         bool open;
-        uint16_t sport;
+        struct esp8266_socket *socket; // Owner of the link
+        uint32_t released; // Order of release, least recently used id is allocated first
+        bool parked; // Connection kept open for reuse, see ESP8266_TCP_POOL
+        uint64_t parked_ms;
+        SocketAddress addr; // Remote end of parked connection
+        bool ssl;
     };
     struct _sock_info _sock_i[ESP8266_SOCKET_COUNT];
+    uint32_t _sock_released;
+    struct esp8266_socket *_socks; // All open sockets, with or without a link
+    Mutex _link_mutex;
+    uint32_t _evictions;
+    int _link_alloc();
+    void _link_release(int id);
+    int _link_evict();
+    int _link_pin(struct esp8266_socket *socket);
+    void _link_unpin(struct esp8266_socket *socket);
+    int _link_attach(struct esp8266_socket *socket);
+
+    // Parked TCP connections
+    tcp_pool_stats _pool_stats;
+    int _pool_drop();
+    bool _pool_park(struct esp8266_socket *socket);
+    bool _pool_take(struct esp8266_socket *socket, const SocketAddress &addr);
+    void _pool_miss(uint32_t ms);
+
+    // Send coalescing, see ESP8266_SNDLOWAT
+    int _tx_event_id;
+    int _tx_buffer(struct esp8266_socket *socket, const void *data, unsigned size);
+    nsapi_error_t _tx_flush(struct esp8266_socket *socket);
+    nsapi_error_t _tx_error(struct esp8266_socket *socket);
+    void _tx_flush_evnt();
+    nsapi_error_t _tx_resize(struct esp8266_socket *socket, uint32_t sndbuf, uint32_t sndlowat);
+
+    // UDP sockets sharing one mode 2 link, datagrams told apart by remote end
+    int _shared_id; // Link, -1 if not open
+    struct {
+        void (*callback)(void *);
+        void *data;
+        SocketAddress peer; // Remote end whose datagrams the socket receives
+    } _shared_cbs[ESP8266_UDP_SHARED_SOCKETS];
+    bool _shared_used[ESP8266_UDP_SHARED_SOCKETS];
+    void _shared_attach(struct esp8266_socket *socket);
+    void _shared_detach(struct esp8266_socket *socket);
+    bool _shared_claim(struct esp8266_socket *socket, const SocketAddress &addr);
+    nsapi_error_t _shared_send(const SocketAddress &addr, ESP8266::udp_send *sends, unsigned count, int *done);
+    nsapi_error_t _shared_open(const SocketAddress &addr);
+    void _shared_close();
+    void _shared_lost();
+
+    // Reconnect mode 0 UDP link to addr unless already there
+    nsapi_error_t _udp_connect(struct esp8266_socket *socket, const SocketAddress &addr);
 
     // Driver's state
     int _initialized;
@@ -350,10 +819,54 @@ private:
         void *data;
     } _cbs[ESP8266_SOCKET_COUNT];
     void event();
+    void socket_event(int id);
 
     // Connection state reporting to application
     nsapi_connection_status_t _conn_stat;
     Callback<void(nsapi_event_t, intptr_t)> _conn_stat_cb;
+
+    // Background OOB processing
+    volatile int _oob_event_id;
+    events::EventQueue _queue; // Kept off mbed_event_queue(), rejoin and roaming block for seconds
+    rtos::Thread _thread;
+    void proc_oob_evnt();
+
+    // Automatic rejoin
+    bool _auto_reconnect;
+    int _reconnect_event_id;
+    uint64_t _reconnect_down_ms; // When connection dropped, 0 if up
+    int _reconnect_backoff;
+    reconnect_stats _reconnect_stats;
+    bool _reconnect_setup; // Modem's configuration to be replayed first
+    void _reconnect_schedule();
+    void _reconnect();
+    void _reconnect_done();
+    void _reconnect_cancel();
+    uint32_t _rand_state;
+    void _random_seed();
+    uint32_t _random();
+
+    // Roaming, see set_roaming
+    bool _roam_enabled;
+    int8_t _roam_threshold;
+    int _roam_event_id;
+    bool _roam_active; // Scanning or switching access points
+    bool _roam_switching; // Joining the new access point, its disconnect is expected
+    char _roam_ssid[ESP8266_SSID_MAX_LENGTH + 1];
+    uint8_t _roam_bssid[6]; // Access point joined
+    int8_t _roam_rssi;
+    bool _roam_found;
+    uint8_t _roam_target[6]; // Strongest one found by the scan
+    int8_t _roam_target_rssi;
+    roam_stats _roam_stats;
+    uint64_t _roam_start; // Join to the new access point started
+    void _roam_schedule();
+    void _roam_check();
+    void _roam_scan_result(const WiFiAccessPoint *ap, int status);
+    void _roam();
+    void _roam_joined(nsapi_error_t status);
+    void _roam_done(nsapi_error_t status);
+    nsapi_error_t _restore();
 };
 
 #endif